@@ -11,19 +11,25 @@ include $(CLEAR_VARS)
 LOCAL_MODULE_RELATIVE_PATH := hw
 LOCAL_SHARED_LIBRARIES := liblog libEGL libutils libcutils libhardware libsync libfbcnf libhardware_legacy
 LOCAL_STATIC_LIBRARIES := libomxutil
-LOCAL_SRC_FILES := hwcomposer.cpp
+LOCAL_SRC_FILES := hwcomposer.cpp \
+    LayerTrace.cpp \
+    BufferCache.cpp \
+    Telemetry.cpp \
+    CostModel.cpp \
+    FenceWaiter.cpp
 
-LOCAL_KK=0
+HWC_MALI_AFBC_GRALLOC := 0
 ifeq ($(GPU_TYPE),t83x)
-LOCAL_KK:=1
+HWC_MALI_AFBC_GRALLOC := 1
 endif
 ifeq ($(GPU_ARCH),midgard)
-LOCAL_KK:=1
+HWC_MALI_AFBC_GRALLOC := 1
 endif
-ifeq ($(LOCAL_KK),1)
-	LOCAL_CFLAGS += -DMALI_AFBC_GRALLOC=1
-else
-	LOCAL_CFLAGS += -DMALI_AFBC_GRALLOC=0
+LOCAL_CFLAGS += -DMALI_AFBC_GRALLOC=$(HWC_MALI_AFBC_GRALLOC)
+
+# fb targets SurfaceFlinger allocates, the osds are never sized below it.
+ifneq ($(NUM_FRAMEBUFFER_SURFACE_BUFFERS),)
+LOCAL_CFLAGS += -DNUM_FRAMEBUFFER_SURFACE_BUFFERS=$(NUM_FRAMEBUFFER_SURFACE_BUFFERS)
 endif
 
 MESON_GRALLOC_DIR ?= hardware/amlogic/gralloc
@@ -49,6 +55,19 @@ LOCAL_CFLAGS += -DSINGLE_EXTERNAL_DISPLAY_USE_FB1
 endif
 endif
 
+ifeq ($(TARGET_HWC_DISABLE_TRACE),true)
+LOCAL_CFLAGS += -DHWC_DISABLE_TRACE
+endif
+
+# KMS backend, picked at runtime with ro.hwc.backend=drm.
+ifeq ($(TARGET_HWC_DRM_BACKEND),true)
+LOCAL_SRC_FILES += DrmBackend.cpp
+LOCAL_SHARED_LIBRARIES += libdrm
+LOCAL_C_INCLUDES += external/libdrm \
+    external/libdrm/include/drm
+LOCAL_CFLAGS += -DHWC_DRM_BACKEND
+endif
+
 LOCAL_MODULE := hwcomposer.amlogic
 LOCAL_CFLAGS += -DLOG_TAG=\"hwcomposer\"
 LOCAL_MODULE_TAGS := optional
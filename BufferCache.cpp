@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "HWComposer"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+// for private_handle_t
+#include <gralloc_priv.h>
+
+#include "BufferCache.h"
+
+//handles are heap allocated, the low bits carry no information.
+static uint32_t buffer_cache_hash(buffer_handle_t handle) {
+    uint32_t key = (uint32_t)((uintptr_t)handle >> 4);
+    return (key * 2654435761u) & (HWC_BUFFER_CACHE_SIZE - 1);
+}
+
+static bool buffer_cache_idle(hwc_buffer_cache_t* cache, hwc_buffer_info_t const* info) {
+    return !info->handle || cache->frame - info->last_used > HWC_BUFFER_CACHE_MAX_AGE;
+}
+
+hwc_buffer_info_t* hwc_buffer_cache_get(hwc_buffer_cache_t* cache, buffer_handle_t handle,
+        hwc_buffer_fill_t fill, void* data) {
+    if (!handle) return NULL;
+
+    private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(handle);
+    uint32_t slot = buffer_cache_hash(handle);
+    hwc_buffer_info_t* victim = NULL;
+    hwc_buffer_info_t* oldest = NULL;
+
+    for (int i = 0; i < HWC_BUFFER_CACHE_PROBES; i++) {
+        hwc_buffer_info_t* info = &cache->entries[(slot + i) & (HWC_BUFFER_CACHE_SIZE - 1)];
+        if (info->handle == handle) {
+            if (info->share_fd == hnd->share_fd) {
+                cache->hits++;
+                info->last_used = cache->frame;
+                return info;
+            }
+            //freed and its address handed to another buffer.
+            victim = info;
+            break;
+        }
+        if (!victim && buffer_cache_idle(cache, info)) victim = info;
+        if (!oldest || cache->frame - info->last_used > cache->frame - oldest->last_used) {
+            oldest = info;
+        }
+    }
+
+    if (private_handle_t::validate(handle) < 0) return NULL;
+
+    cache->misses++;
+    if (!victim) {
+        victim = oldest;
+        cache->evictions++;
+    }
+
+    memset(victim, 0, sizeof(hwc_buffer_info_t));
+    victim->handle = handle;
+    victim->share_fd = hnd->share_fd;
+    victim->format = hnd->format;
+    victim->width = hnd->width;
+    victim->height = hnd->height;
+    victim->stride = hnd->stride;
+    victim->scanout = HWC_SCANOUT_UNKNOWN;
+    victim->generation = ++cache->generation;
+    victim->last_used = cache->frame;
+    if (hnd->flags & private_handle_t::PRIV_FLAGS_VIDEO_OVERLAY) victim->flags |= HWC_BUFFER_VIDEO_OVERLAY;
+    if (hnd->flags & private_handle_t::PRIV_FLAGS_OSD_VIDEO_OMX) victim->flags |= HWC_BUFFER_OSD_VIDEO_OMX;
+    if (hnd->flags & private_handle_t::PRIV_FLAGS_FRAMEBUFFER) victim->flags |= HWC_BUFFER_FRAMEBUFFER;
+    if (fill) fill(victim, data);
+
+    ALOGV("buffer cache: load %p gen %u", handle, victim->generation);
+    return victim;
+}
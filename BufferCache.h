@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HWC_BUFFER_CACHE_H
+#define HWC_BUFFER_CACHE_H
+
+#include <stdint.h>
+#include <hardware/hwcomposer.h>
+
+/*
+Per-buffer facts, derived once from the private_handle_t and kept in a
+small open addressing table keyed by the handle pointer.
+
+The HAL is never told when SurfaceFlinger frees a buffer, and a freed
+handle's address is soon reused. An entry is therefore keyed by the handle
+together with its share fd, the one field of the handle a hit reads: a
+buffer that takes over a freed handle's address comes with another share
+fd, unless its import got the freed fd number back as well. That rare
+case is traded for not reading the handle on every hit. Everything else
+is read from the handle only on a miss, which loads the entry with a new
+generation. Entries idle for
+HWC_BUFFER_CACHE_MAX_AGE frames are free to be reused.
+
+One cache per display. Each one is only touched by the thread posting that
+display, so there is no locking.
+*/
+
+#define HWC_BUFFER_CACHE_SIZE       64  //must be power of 2
+#define HWC_BUFFER_CACHE_PROBES     8
+#define HWC_BUFFER_CACHE_MAX_AGE    120
+
+enum {
+    HWC_BUFFER_VIDEO_OVERLAY    = 1 << 0,
+    HWC_BUFFER_OSD_VIDEO_OMX    = 1 << 1,
+    HWC_BUFFER_AFBC             = 1 << 2,
+    HWC_BUFFER_FRAMEBUFFER      = 1 << 3,
+    HWC_BUFFER_OPAQUE           = 1 << 4,
+};
+
+//direct scanout decision of the backend, kept per buffer.
+enum {
+    HWC_SCANOUT_UNKNOWN = 0,
+    HWC_SCANOUT_YES,
+    HWC_SCANOUT_NO,
+};
+
+typedef struct hwc_buffer_info_t {
+    //the key.
+    buffer_handle_t handle;
+    int share_fd;
+    uint32_t flags;
+    int32_t format;
+    int32_t width;
+    int32_t height;
+    int32_t stride;
+    //estimated bytes fetched to scan the buffer out once.
+    uint32_t scan_bytes;
+    int32_t scanout;
+    //changes whenever the entry is refilled, e.g. for cursor uploads.
+    uint32_t generation;
+    uint32_t last_used;
+} hwc_buffer_info_t;
+
+typedef struct hwc_buffer_cache_t {
+    uint32_t frame;
+    uint32_t generation;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    hwc_buffer_info_t entries[HWC_BUFFER_CACHE_SIZE];
+} hwc_buffer_cache_t;
+
+/* fills the derived facts of a freshly (re)loaded entry, see hwcomposer.cpp. */
+typedef void (*hwc_buffer_fill_t)(hwc_buffer_info_t* info, void* data);
+
+/*
+Entry of handle, loaded through fill on a miss. NULL if handle is not a
+valid private_handle_t. The pointer stays valid until the next lookup.
+*/
+hwc_buffer_info_t* hwc_buffer_cache_get(hwc_buffer_cache_t* cache, buffer_handle_t handle,
+        hwc_buffer_fill_t fill, void* data);
+
+static inline void hwc_buffer_cache_next_frame(hwc_buffer_cache_t* cache) {
+    cache->frame++;
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "CostModel.h"
+
+uint32_t hwc_cost_buffer_bytes(uint32_t width, uint32_t height, uint32_t bytes, bool afbc) {
+    if (!afbc) return bytes;
+
+    uint32_t blocks = ((width + 15) / 16) * ((height + 15) / 16);
+    return blocks * 16 + bytes * HWC_AFBC_BODY_PERCENT / 100;
+}
+
+static uint64_t rect_area(int left, int top, int right, int bottom) {
+    if (right <= left || bottom <= top) return 0;
+    return (uint64_t)(right - left) * (bottom - top);
+}
+
+static uint64_t crop_area(hwc_layer_1_t const* l) {
+    hwc_frect_t const* crop = &l->sourceCropf;
+    return rect_area((int)crop->left, (int)crop->top, (int)crop->right, (int)crop->bottom);
+}
+
+hwc_cost_t hwc_cost_layer(int path, hwc_layer_1_t const* l, hwc_buffer_info_t const* info) {
+    hwc_cost_t cost;
+    memset(&cost, 0, sizeof(cost));
+
+    switch (path) {
+        case HWC_PATH_GLES: {
+            //only the cropped part is sampled, whatever it is scaled to.
+            if (!info || info->width <= 0 || info->height <= 0) break;
+            uint64_t area = (uint64_t)info->width * info->height;
+            uint64_t crop = crop_area(l);
+            cost.read = crop && crop < area ? info->scan_bytes * crop / area : info->scan_bytes;
+            break;
+        }
+        case HWC_PATH_OSD:
+        case HWC_PATH_DIRECT:
+            //the osd fetches the whole buffer, it can't crop.
+            if (info) cost.read = info->scan_bytes;
+            break;
+        case HWC_PATH_VIDEO: {
+            //decoder output is 12 bit nv21, a sideband stream has no buffer to size it by.
+            uint64_t area = crop_area(l);
+            if (!area || l->compositionType == HWC_SIDEBAND) {
+                hwc_rect_t const* frame = &l->displayFrame;
+                area = rect_area(frame->left, frame->top, frame->right, frame->bottom);
+            }
+            cost.read = area * 3 / 2;
+            break;
+        }
+        case HWC_PATH_BACKGROUND:
+        default:
+            break;
+    }
+    return cost;
+}
+
+void hwc_cost_frame_finish(hwc_frame_cost_t* frame, uint32_t xres, uint32_t yres,
+        bool fb_afbc, bool gles_pass, bool fb_scanned) {
+    uint32_t bytes = hwc_cost_buffer_bytes(xres, yres, xres * yres * 4, fb_afbc);
+
+    frame->fb_target.write = gles_pass ? bytes : 0;
+    frame->fb_target.read = fb_scanned ? bytes : 0;
+    frame->total += frame->fb_target.write + frame->fb_target.read;
+}
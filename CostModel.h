@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HWC_COST_MODEL_H
+#define HWC_COST_MODEL_H
+
+#include <stdint.h>
+#include <hardware/hwcomposer.h>
+
+#include "BufferCache.h"
+
+/*
+Estimated DDR bytes one frame of a display moves, per composition path.
+
+Mali is a tiler: GLES reads every source once and writes the fb target
+once, blending and solid fills stay in tile memory. The osd and the vpp
+fetch what they show on every refresh, the vpp draws its background
+itself. An afbc buffer is read as a 16 byte header per 16x16 block plus
+the compressed body, and ui content compresses to about
+HWC_AFBC_BODY_PERCENT.
+*/
+
+#define HWC_AFBC_BODY_PERCENT   50
+
+//MB/s over which a frame is counted, unset or <= 0 for none. A counter
+//for monitoring, it changes no composition decision.
+#define HWC_PROP_DDR_THRESHOLD  "persist.sys.hwc.ddr_threshold"
+
+enum {
+    HWC_PATH_GLES = 0,
+    HWC_PATH_OSD,           //a plane of its own, the cursor osd
+    HWC_PATH_VIDEO,
+    HWC_PATH_DIRECT,
+    HWC_PATH_BACKGROUND,
+    HWC_PATH_NUM
+};
+
+typedef struct hwc_cost_t {
+    uint64_t read;
+    uint64_t write;
+} hwc_cost_t;
+
+typedef struct hwc_frame_cost_t {
+    hwc_cost_t paths[HWC_PATH_NUM];
+    //fb target written by the GLES pass and fetched by the osd.
+    hwc_cost_t fb_target;
+    uint64_t total;
+} hwc_frame_cost_t;
+
+/* bytes fetched to read a width x height buffer of bytes, compressed or not. */
+uint32_t hwc_cost_buffer_bytes(uint32_t width, uint32_t height, uint32_t bytes, bool afbc);
+
+/* what putting l on path costs. info is NULL for a layer without buffer. */
+hwc_cost_t hwc_cost_layer(int path, hwc_layer_1_t const* l, hwc_buffer_info_t const* info);
+
+static inline uint64_t hwc_cost_bytes(hwc_cost_t c) {
+    return c.read + c.write;
+}
+
+static inline void hwc_cost_frame_add(hwc_frame_cost_t* frame, int path, hwc_cost_t c) {
+    frame->paths[path].read += c.read;
+    frame->paths[path].write += c.write;
+    frame->total += c.read + c.write;
+}
+
+/*
+Close a frame: a GLES pass writes the xres x yres fb target, and unless a
+layer is scanned out in its place the osd fetches the fb target.
+*/
+void hwc_cost_frame_finish(hwc_frame_cost_t* frame, uint32_t xres, uint32_t yres,
+        bool fb_afbc, bool gles_pass, bool fb_scanned);
+
+/* a frame's cost sustained at refresh_ns intervals, in bytes per second. */
+static inline uint64_t hwc_cost_rate(hwc_frame_cost_t const* frame, int64_t refresh_ns) {
+    return refresh_ns > 0 ? frame->total * 1000000000ull / refresh_ns : 0;
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HWC_DISPLAY_BACKEND_H
+#define HWC_DISPLAY_BACKEND_H
+
+#include <stdint.h>
+#include <hardware/hwcomposer.h>
+#include <utils/Timers.h>
+
+/*
+Display I/O of the HAL.
+
+hwcomposer.cpp only reaches the display hardware through these ops. The
+fbdev backend in hwcomposer.cpp drives the osd devices through libfbcnf.
+The DRM backend (HWC_DRM_BACKEND builds) drives a KMS device with atomic
+commits. Ops a backend can't do return -ENOSYS and are also left out of its
+caps.
+*/
+
+#define HWC_PROP_BACKEND            "ro.hwc.backend"
+#define HWC_DRM_PROP_DEVICE         "ro.hwc.drm.device"
+#define HWC_DRM_DEFAULT_DEVICE      "/dev/dri/card0"
+
+enum {
+    //cursor layers go to their own plane, see set_cursor.
+    HWC_BACKEND_CAP_CURSOR      = 1 << 0,
+    //test() really asks the hardware.
+    HWC_BACKEND_CAP_TEST        = 1 << 1,
+    //wait_vblank() waits for the vblank of the display.
+    HWC_BACKEND_CAP_VBLANK      = 1 << 2,
+};
+
+typedef struct hwc_backend_mode_t {
+    uint32_t xres;
+    uint32_t yres;
+    //physical size in mm, 0 if the sink doesn't report it.
+    uint32_t width;
+    uint32_t height;
+    //0 if unknown, the output mode node decides then.
+    int32_t vsync_period;
+} hwc_backend_mode_t;
+
+struct hwc_backend_t;
+
+typedef struct hwc_backend_ops_t {
+    const char* name;
+    void (*close)(struct hwc_backend_t* be);
+    //bring up disp, -ENODEV if nothing is connected to it.
+    int (*init_display)(struct hwc_backend_t* be, int disp);
+    int (*get_mode)(struct hwc_backend_t* be, int disp, hwc_backend_mode_t* mode);
+    uint32_t (*caps)(struct hwc_backend_t* be, int disp);
+    //dry run: 0 if layer can be scanned out on the main plane of disp as is.
+    int (*test)(struct hwc_backend_t* be, int disp, hwc_layer_1_t const* layer);
+    /*
+    Show hnd full screen on disp. The backend owns acquire_fence from here on,
+    *release_fence signals once hnd is no longer scanned out.
+    */
+    int (*post)(struct hwc_backend_t* be, int disp, buffer_handle_t hnd,
+            int acquire_fence, int* release_fence);
+    //show hnd as cursor image, NULL hides the cursor.
+    int (*set_cursor)(struct hwc_backend_t* be, int disp, buffer_handle_t hnd);
+    int (*set_cursor_pos)(struct hwc_backend_t* be, int disp, int x, int y);
+    int (*wait_vblank)(struct hwc_backend_t* be, int disp, nsecs_t* timestamp);
+} hwc_backend_ops_t;
+
+typedef struct hwc_backend_t {
+    const hwc_backend_ops_t* ops;
+    void* priv;
+} hwc_backend_t;
+
+#ifdef HWC_DRM_BACKEND
+/* open the KMS device named by HWC_DRM_PROP_DEVICE, 0 on success. */
+int drm_backend_open(hwc_backend_t* be);
+#endif
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HWC_DISPLAY_POLICY_H
+#define HWC_DISPLAY_POLICY_H
+
+/*
+The product configuration as compile-time constants. The build flags are
+only read here. The HAL tests hwc_policy with plain ifs, so every product's
+paths are compiled and type checked in every build, and the compiler drops
+the branches a product doesn't take from hwc_prepare and fb_post.
+
+#if is left only where a flag decides which headers and libraries exist:
+WITH_LIBPLAYER_MODULE (libamavutils) and MALI_AFBC_GRALLOC (the
+internal_format of gralloc handles).
+*/
+
+#ifdef WITH_EXTERNAL_DISPLAY
+#define HWC_POLICY_EXTERNAL_DISPLAY     true
+#else
+#define HWC_POLICY_EXTERNAL_DISPLAY     false
+#endif
+
+#ifdef SINGLE_EXTERNAL_DISPLAY_USE_FB1
+#define HWC_POLICY_FB1_EXTERNAL         true
+#else
+#define HWC_POLICY_FB1_EXTERNAL         false
+#endif
+
+#ifdef USE_HW_VSYNC
+#define HWC_POLICY_HW_VSYNC             true
+#else
+#define HWC_POLICY_HW_VSYNC             false
+#endif
+
+#if WITH_LIBPLAYER_MODULE
+#define HWC_POLICY_LIBPLAYER            true
+#else
+#define HWC_POLICY_LIBPLAYER            false
+#endif
+
+#if MALI_AFBC_GRALLOC
+#define HWC_POLICY_AFBC_GRALLOC         true
+#else
+#define HWC_POLICY_AFBC_GRALLOC         false
+#endif
+
+struct hwc_policy {
+    //hdmi is a second display with its own osd, hotplugged.
+    static const bool external_display = HWC_POLICY_EXTERNAL_DISPLAY;
+    //the external display runs on fb1, the primary osd is left alone while it is connected.
+    static const bool fb1_external = HWC_POLICY_FB1_EXTERNAL;
+    //cursor layers on an osd of their own (hwc 1.4), fb1 mode has no osd left for them.
+    static const bool cursor_layer = !HWC_POLICY_FB1_EXTERNAL;
+    //vsync from FBIO_WAITFORVSYNC instead of the software timer, still has bugs.
+    static const bool hw_vsync = HWC_POLICY_HW_VSYNC;
+    static const bool libplayer = HWC_POLICY_LIBPLAYER;
+    static const bool afbc_gralloc = HWC_POLICY_AFBC_GRALLOC;
+};
+
+#endif
@@ -0,0 +1,608 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+DRM/KMS backend.
+
+Every connected connector becomes a display, in connector order: the first
+one is primary, the second external. Each display gets a crtc and that
+crtc's primary plane. Frames are posted with non-blocking atomic commits
+that carry the acquire fence as IN_FENCE_FD and return OUT_FENCE_PTR as the
+release fence. test() asks the kernel through DRM_MODE_ATOMIC_TEST_ONLY.
+Runs on any KMS driver, vkms included.
+*/
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "HWComposer"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <sync/sync.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+
+// for private_handle_t
+#include <gralloc_priv.h>
+
+#include "DisplayBackend.h"
+
+#define DRM_MAX_DISPLAYS    HWC_NUM_PHYSICAL_DISPLAY_TYPES
+#define DRM_FB_CACHE_SIZE   8
+//commits a display can have in flight plus the one on screen.
+#define DRM_FLIGHT_SIZE     3
+
+typedef struct drm_plane_props_t {
+    uint32_t fb_id;
+    uint32_t crtc_id;
+    uint32_t src_x, src_y, src_w, src_h;
+    uint32_t crtc_x, crtc_y, crtc_w, crtc_h;
+    uint32_t in_fence_fd;
+} drm_plane_props_t;
+
+typedef struct drm_display_t {
+    bool connected;
+    uint32_t connector_id;
+    uint32_t crtc_id;
+    int crtc_index;
+    uint32_t plane_id;
+    drmModeModeInfo mode;
+    uint32_t mode_blob;
+    uint32_t mm_width;
+    uint32_t mm_height;
+    //the first commit also does the modeset.
+    bool active;
+
+    uint32_t conn_crtc_id;
+    uint32_t crtc_mode_id;
+    uint32_t crtc_active;
+    uint32_t crtc_out_fence_ptr;
+    drm_plane_props_t plane;
+
+    //fbs of the last commits, oldest first, each with its out fence. See drm_flight_retire().
+    uint32_t flight_fb[DRM_FLIGHT_SIZE];
+    int flight_fence[DRM_FLIGHT_SIZE];
+    int flights;
+} drm_display_t;
+
+//framebuffer objects of recently posted buffers, SurfaceFlinger cycles a few.
+typedef struct drm_fb_t {
+    buffer_handle_t hnd;
+    int share_fd;
+    uint32_t fb_id;
+} drm_fb_t;
+
+typedef struct drm_backend_t {
+    int fd;
+    //primary posts on the SurfaceFlinger thread and external on its post worker.
+    pthread_mutex_t lock;
+    drm_display_t displays[DRM_MAX_DISPLAYS];
+    drm_fb_t fbs[DRM_FB_CACHE_SIZE];
+    int fb_next;
+} drm_backend_t;
+
+static uint32_t drm_prop_id(int fd, uint32_t obj_id, uint32_t obj_type, const char* name) {
+    drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+    uint32_t id = 0;
+
+    if (!props) return 0;
+    for (uint32_t i = 0; i < props->count_props && !id; i++) {
+        drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+        if (!prop) continue;
+        if (!strcmp(prop->name, name)) id = prop->prop_id;
+        drmModeFreeProperty(prop);
+    }
+    drmModeFreeObjectProperties(props);
+    return id;
+}
+
+static uint64_t drm_prop_value(int fd, uint32_t obj_id, uint32_t obj_type, const char* name) {
+    drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+    uint64_t value = 0;
+
+    if (!props) return 0;
+    for (uint32_t i = 0; i < props->count_props; i++) {
+        drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+        if (!prop) continue;
+        bool match = !strcmp(prop->name, name);
+        drmModeFreeProperty(prop);
+        if (match) {
+            value = props->prop_values[i];
+            break;
+        }
+    }
+    drmModeFreeObjectProperties(props);
+    return value;
+}
+
+static uint32_t drm_format(int hal_format) {
+    switch (hal_format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+            return DRM_FORMAT_ABGR8888;
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+            return DRM_FORMAT_XBGR8888;
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            return DRM_FORMAT_ARGB8888;
+        case HAL_PIXEL_FORMAT_RGB_888:
+            return DRM_FORMAT_BGR888;
+        case HAL_PIXEL_FORMAT_RGB_565:
+            return DRM_FORMAT_RGB565;
+        default:
+            return 0;
+    }
+}
+
+static uint32_t drm_format_bpp(uint32_t format) {
+    switch (format) {
+        case DRM_FORMAT_RGB565:
+            return 2;
+        case DRM_FORMAT_BGR888:
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+/*
+A commit's out fence signals once its fb is on screen, which is also when
+the fb of every earlier commit stops being scanned out. Forget those, the
+newest completed commit and the ones still pending keep their fbs.
+*/
+static void drm_flight_retire(drm_display_t* d) {
+    int done = -1;
+
+    for (int i = d->flights - 1; i >= 0 && done < 0; i--) {
+        if (d->flight_fence[i] < 0 || sync_wait(d->flight_fence[i], 0) == 0) done = i;
+    }
+    if (done <= 0) return;
+
+    for (int i = 0; i < done; i++) {
+        if (d->flight_fence[i] >= 0) close(d->flight_fence[i]);
+    }
+    for (int i = done; i < d->flights; i++) {
+        d->flight_fb[i - done] = d->flight_fb[i];
+        d->flight_fence[i - done] = d->flight_fence[i];
+    }
+    d->flights -= done;
+}
+
+static void drm_flight_push(drm_display_t* d, uint32_t fb_id, int out_fence) {
+    drm_flight_retire(d);
+    if (d->flights == DRM_FLIGHT_SIZE) {
+        //the kernel refuses more non-blocking commits than that, keep the newest.
+        if (d->flight_fence[0] >= 0) close(d->flight_fence[0]);
+        memmove(&d->flight_fb[0], &d->flight_fb[1], (DRM_FLIGHT_SIZE - 1) * sizeof(d->flight_fb[0]));
+        memmove(&d->flight_fence[0], &d->flight_fence[1], (DRM_FLIGHT_SIZE - 1) * sizeof(d->flight_fence[0]));
+        d->flights--;
+    }
+    d->flight_fb[d->flights] = fb_id;
+    d->flight_fence[d->flights] = out_fence >= 0 ? dup(out_fence) : -1;
+    d->flights++;
+}
+
+static void drm_flight_clear(drm_display_t* d) {
+    for (int i = 0; i < d->flights; i++) {
+        if (d->flight_fence[i] >= 0) close(d->flight_fence[i]);
+    }
+    d->flights = 0;
+}
+
+//on screen or pending on any crtc, removing it would disable the plane.
+static bool drm_fb_busy(drm_backend_t* drm, uint32_t fb_id) {
+    for (int i = 0; i < DRM_MAX_DISPLAYS; i++) {
+        drm_display_t* d = &drm->displays[i];
+        for (int f = 0; f < d->flights; f++) {
+            if (d->flight_fb[f] == fb_id) return true;
+        }
+    }
+    return false;
+}
+
+//called with drm->lock held.
+static uint32_t drm_fb_get(drm_backend_t* drm, buffer_handle_t handle) {
+    if (private_handle_t::validate(handle) < 0) return 0;
+    private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(handle);
+
+    for (int i = 0; i < DRM_FB_CACHE_SIZE; i++) {
+        if (drm->fbs[i].fb_id && drm->fbs[i].hnd == handle
+            && drm->fbs[i].share_fd == hnd->share_fd) {
+            return drm->fbs[i].fb_id;
+        }
+    }
+
+    //the oldest slot whose fb isn't scanned out, a full cache of busy fbs can't take another.
+    int next = -1;
+    for (int i = 0; i < DRM_FB_CACHE_SIZE && next < 0; i++) {
+        int slot = (drm->fb_next + i) % DRM_FB_CACHE_SIZE;
+        if (!drm->fbs[slot].fb_id || !drm_fb_busy(drm, drm->fbs[slot].fb_id)) next = slot;
+    }
+    if (next < 0) {
+        ALOGE("drm: all %d cached fbs are on screen", DRM_FB_CACHE_SIZE);
+        return 0;
+    }
+
+    uint32_t format = drm_format(hnd->format);
+    if (!format) {
+        ALOGE("drm: no fourcc for hal format %d", hnd->format);
+        return 0;
+    }
+
+    uint32_t gem_handle = 0;
+    if (drmPrimeFDToHandle(drm->fd, hnd->share_fd, &gem_handle)) {
+        ALOGE("drm: import buffer fail: %s", strerror(errno));
+        return 0;
+    }
+
+    uint32_t handles[4] = {gem_handle};
+    uint32_t pitches[4] = {hnd->stride * drm_format_bpp(format)};
+    uint32_t offsets[4] = {0};
+    uint32_t fb_id = 0;
+    if (drmModeAddFB2(drm->fd, hnd->width, hnd->height, format,
+            handles, pitches, offsets, &fb_id, 0)) {
+        ALOGE("drm: add fb %dx%d fail: %s", hnd->width, hnd->height, strerror(errno));
+        fb_id = 0;
+    }
+
+    //the fb holds its own reference to the gem object.
+    struct drm_gem_close gem_close;
+    memset(&gem_close, 0, sizeof(gem_close));
+    gem_close.handle = gem_handle;
+    drmIoctl(drm->fd, DRM_IOCTL_GEM_CLOSE, &gem_close);
+    if (!fb_id) return 0;
+
+    drm_fb_t* slot = &drm->fbs[next];
+    drm->fb_next = (next + 1) % DRM_FB_CACHE_SIZE;
+    if (slot->fb_id) drmModeRmFB(drm->fd, slot->fb_id);
+    slot->hnd = handle;
+    slot->share_fd = hnd->share_fd;
+    slot->fb_id = fb_id;
+    return fb_id;
+}
+
+static int drm_find_crtc(drm_backend_t* drm, drmModeResPtr res,
+        drmModeConnectorPtr conn, drm_display_t* display) {
+    for (int e = 0; e < conn->count_encoders; e++) {
+        drmModeEncoderPtr enc = drmModeGetEncoder(drm->fd, conn->encoders[e]);
+        if (!enc) continue;
+
+        for (int c = 0; c < res->count_crtcs; c++) {
+            if (!(enc->possible_crtcs & (1 << c))) continue;
+
+            bool used = false;
+            for (int d = 0; d < DRM_MAX_DISPLAYS; d++) {
+                used |= drm->displays[d].connected && drm->displays[d].crtc_id == res->crtcs[c];
+            }
+            if (used) continue;
+
+            display->crtc_id = res->crtcs[c];
+            display->crtc_index = c;
+            drmModeFreeEncoder(enc);
+            return 0;
+        }
+        drmModeFreeEncoder(enc);
+    }
+    return -ENODEV;
+}
+
+static int drm_find_plane(drm_backend_t* drm, drm_display_t* display) {
+    drmModePlaneResPtr planes = drmModeGetPlaneResources(drm->fd);
+    if (!planes) return -errno;
+
+    for (uint32_t i = 0; i < planes->count_planes && !display->plane_id; i++) {
+        drmModePlanePtr plane = drmModeGetPlane(drm->fd, planes->planes[i]);
+        if (!plane) continue;
+        if ((plane->possible_crtcs & (1 << display->crtc_index))
+            && drm_prop_value(drm->fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, "type")
+                == DRM_PLANE_TYPE_PRIMARY) {
+            display->plane_id = plane->plane_id;
+        }
+        drmModeFreePlane(plane);
+    }
+    drmModeFreePlaneResources(planes);
+    return display->plane_id ? 0 : -ENODEV;
+}
+
+static void drm_lookup_props(int fd, drm_display_t* d) {
+    d->conn_crtc_id = drm_prop_id(fd, d->connector_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+    d->crtc_mode_id = drm_prop_id(fd, d->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID");
+    d->crtc_active = drm_prop_id(fd, d->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE");
+    d->crtc_out_fence_ptr = drm_prop_id(fd, d->crtc_id, DRM_MODE_OBJECT_CRTC, "OUT_FENCE_PTR");
+
+    drm_plane_props_t* p = &d->plane;
+    uint32_t id = d->plane_id;
+    p->fb_id = drm_prop_id(fd, id, DRM_MODE_OBJECT_PLANE, "FB_ID");
+    p->crtc_id = drm_prop_id(fd, id, DRM_MODE_OBJECT_PLANE, "CRTC_ID");
+    p->src_x = drm_prop_id(fd, id, DRM_MODE_OBJECT_PLANE, "SRC_X");
+    p->src_y = drm_prop_id(fd, id, DRM_MODE_OBJECT_PLANE, "SRC_Y");
+    p->src_w = drm_prop_id(fd, id, DRM_MODE_OBJECT_PLANE, "SRC_W");
+    p->src_h = drm_prop_id(fd, id, DRM_MODE_OBJECT_PLANE, "SRC_H");
+    p->crtc_x = drm_prop_id(fd, id, DRM_MODE_OBJECT_PLANE, "CRTC_X");
+    p->crtc_y = drm_prop_id(fd, id, DRM_MODE_OBJECT_PLANE, "CRTC_Y");
+    p->crtc_w = drm_prop_id(fd, id, DRM_MODE_OBJECT_PLANE, "CRTC_W");
+    p->crtc_h = drm_prop_id(fd, id, DRM_MODE_OBJECT_PLANE, "CRTC_H");
+    p->in_fence_fd = drm_prop_id(fd, id, DRM_MODE_OBJECT_PLANE, "IN_FENCE_FD");
+}
+
+static int drm_init_display(hwc_backend_t* be, int disp) {
+    drm_backend_t* drm = (drm_backend_t*)be->priv;
+    drm_display_t* display = &drm->displays[disp];
+    int ret = -ENODEV;
+
+    if (disp >= DRM_MAX_DISPLAYS) return -EINVAL;
+    if (display->connected) return 0;
+
+    drmModeResPtr res = drmModeGetResources(drm->fd);
+    if (!res) return -errno;
+
+    //the disp-th connected connector drives disp.
+    int seen = 0;
+    for (int i = 0; i < res->count_connectors && ret; i++) {
+        drmModeConnectorPtr conn = drmModeGetConnector(drm->fd, res->connectors[i]);
+        if (!conn) continue;
+        if (conn->connection != DRM_MODE_CONNECTED || conn->count_modes == 0 || seen++ != disp) {
+            drmModeFreeConnector(conn);
+            continue;
+        }
+
+        drm_flight_clear(display);
+        memset(display, 0, sizeof(*display));
+        display->connector_id = conn->connector_id;
+        display->mode = conn->modes[0];
+        for (int m = 0; m < conn->count_modes; m++) {
+            if (conn->modes[m].type & DRM_MODE_TYPE_PREFERRED) {
+                display->mode = conn->modes[m];
+                break;
+            }
+        }
+        display->mm_width = conn->mmWidth;
+        display->mm_height = conn->mmHeight;
+
+        ret = drm_find_crtc(drm, res, conn, display);
+        if (!ret) ret = drm_find_plane(drm, display);
+        if (!ret && drmModeCreatePropertyBlob(drm->fd, &display->mode,
+                sizeof(display->mode), &display->mode_blob)) {
+            ret = -errno;
+        }
+        drmModeFreeConnector(conn);
+    }
+    drmModeFreeResources(res);
+
+    if (ret) {
+        ALOGD("drm: nothing for display %d", disp);
+        return ret;
+    }
+
+    drm_lookup_props(drm->fd, display);
+    display->connected = true;
+    ALOGI("drm: display %d on connector %u crtc %u plane %u, %dx%d@%d",
+        disp, display->connector_id, display->crtc_id, display->plane_id,
+        display->mode.hdisplay, display->mode.vdisplay, display->mode.vrefresh);
+    return 0;
+}
+
+static int drm_get_mode(hwc_backend_t* be, int disp, hwc_backend_mode_t* mode) {
+    drm_backend_t* drm = (drm_backend_t*)be->priv;
+    if (disp >= DRM_MAX_DISPLAYS || !drm->displays[disp].connected) return -ENODEV;
+
+    drm_display_t* d = &drm->displays[disp];
+    drmModeModeInfo* m = &d->mode;
+    mode->xres = m->hdisplay;
+    mode->yres = m->vdisplay;
+    mode->width = d->mm_width;
+    mode->height = d->mm_height;
+    mode->vsync_period = m->vrefresh ? 1000000000 / m->vrefresh : 0;
+    return 0;
+}
+
+static uint32_t drm_caps(hwc_backend_t*, int) {
+    return HWC_BACKEND_CAP_TEST | HWC_BACKEND_CAP_VBLANK;
+}
+
+static void drm_add_plane(drmModeAtomicReqPtr req, drm_display_t* d, uint32_t fb_id,
+        hwc_frect_t const* src, hwc_rect_t const* dst) {
+    drm_plane_props_t* p = &d->plane;
+    uint32_t id = d->plane_id;
+
+    drmModeAtomicAddProperty(req, id, p->fb_id, fb_id);
+    drmModeAtomicAddProperty(req, id, p->crtc_id, d->crtc_id);
+    drmModeAtomicAddProperty(req, id, p->src_x, (uint64_t)(src->left * 65536.0f));
+    drmModeAtomicAddProperty(req, id, p->src_y, (uint64_t)(src->top * 65536.0f));
+    drmModeAtomicAddProperty(req, id, p->src_w, (uint64_t)((src->right - src->left) * 65536.0f));
+    drmModeAtomicAddProperty(req, id, p->src_h, (uint64_t)((src->bottom - src->top) * 65536.0f));
+    drmModeAtomicAddProperty(req, id, p->crtc_x, dst->left);
+    drmModeAtomicAddProperty(req, id, p->crtc_y, dst->top);
+    drmModeAtomicAddProperty(req, id, p->crtc_w, dst->right - dst->left);
+    drmModeAtomicAddProperty(req, id, p->crtc_h, dst->bottom - dst->top);
+}
+
+static uint32_t drm_add_modeset(drmModeAtomicReqPtr req, drm_display_t* d) {
+    if (d->active) return 0;
+    drmModeAtomicAddProperty(req, d->connector_id, d->conn_crtc_id, d->crtc_id);
+    drmModeAtomicAddProperty(req, d->crtc_id, d->crtc_mode_id, d->mode_blob);
+    drmModeAtomicAddProperty(req, d->crtc_id, d->crtc_active, 1);
+    return DRM_MODE_ATOMIC_ALLOW_MODESET;
+}
+
+static int drm_test(hwc_backend_t* be, int disp, hwc_layer_1_t const* layer) {
+    drm_backend_t* drm = (drm_backend_t*)be->priv;
+    if (disp >= DRM_MAX_DISPLAYS || !drm->displays[disp].connected) return -ENODEV;
+    drm_display_t* d = &drm->displays[disp];
+    int ret = -EINVAL;
+
+    pthread_mutex_lock(&drm->lock);
+    uint32_t fb_id = drm_fb_get(drm, layer->handle);
+    drmModeAtomicReqPtr req = fb_id ? drmModeAtomicAlloc() : NULL;
+    if (req) {
+        drm_add_plane(req, d, fb_id, &layer->sourceCropf, &layer->displayFrame);
+        uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY | drm_add_modeset(req, d);
+        ret = drmModeAtomicCommit(drm->fd, req, flags, NULL) ? -errno : 0;
+        drmModeAtomicFree(req);
+    } else if (fb_id) {
+        ret = -ENOMEM;
+    }
+    pthread_mutex_unlock(&drm->lock);
+    return ret;
+}
+
+static int drm_post(hwc_backend_t* be, int disp, buffer_handle_t hnd,
+        int acquire_fence, int* release_fence) {
+    drm_backend_t* drm = (drm_backend_t*)be->priv;
+    int ret = -ENODEV;
+
+    *release_fence = -1;
+    if (disp >= DRM_MAX_DISPLAYS || !drm->displays[disp].connected) goto out;
+    //the fb is pinned before anyone else can pick its cache slot.
+    pthread_mutex_lock(&drm->lock);
+    {
+        drm_display_t* d = &drm->displays[disp];
+        uint32_t fb_id = drm_fb_get(drm, hnd);
+        if (!fb_id) {
+            ret = -EINVAL;
+            goto unlock;
+        }
+
+        hwc_frect_t src = {0, 0, (float)d->mode.hdisplay, (float)d->mode.vdisplay};
+        hwc_rect_t dst = {0, 0, d->mode.hdisplay, d->mode.vdisplay};
+        int32_t out_fence = -1;
+
+        drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+        if (!req) {
+            ret = -ENOMEM;
+            goto unlock;
+        }
+        drm_add_plane(req, d, fb_id, &src, &dst);
+        if (acquire_fence >= 0) {
+            drmModeAtomicAddProperty(req, d->plane_id, d->plane.in_fence_fd, acquire_fence);
+        }
+        drmModeAtomicAddProperty(req, d->crtc_id, d->crtc_out_fence_ptr, (uint64_t)(uintptr_t)&out_fence);
+        uint32_t flags = drm_add_modeset(req, d);
+        //a modeset has to block, page flips don't.
+        if (!flags) flags = DRM_MODE_ATOMIC_NONBLOCK;
+
+        ret = drmModeAtomicCommit(drm->fd, req, flags, NULL) ? -errno : 0;
+        drmModeAtomicFree(req);
+        if (ret) {
+            ALOGE("drm: commit on display %d fail: %s", disp, strerror(-ret));
+        } else {
+            d->active = true;
+            *release_fence = out_fence;
+            drm_flight_push(d, fb_id, out_fence);
+        }
+    }
+
+unlock:
+    pthread_mutex_unlock(&drm->lock);
+out:
+    //the kernel takes its own reference to the in-fence.
+    if (acquire_fence >= 0) close(acquire_fence);
+    return ret;
+}
+
+static int drm_set_cursor(hwc_backend_t*, int, buffer_handle_t) {
+    return -ENOSYS;
+}
+
+static int drm_set_cursor_pos(hwc_backend_t*, int, int, int) {
+    return -ENOSYS;
+}
+
+static int drm_wait_vblank(hwc_backend_t* be, int disp, nsecs_t* timestamp) {
+    drm_backend_t* drm = (drm_backend_t*)be->priv;
+    if (disp >= DRM_MAX_DISPLAYS || !drm->displays[disp].active) return -ENODEV;
+
+    drmVBlank vbl;
+    memset(&vbl, 0, sizeof(vbl));
+    int index = drm->displays[disp].crtc_index;
+    vbl.request.type = (drmVBlankSeqType)(DRM_VBLANK_RELATIVE
+            | ((index << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK));
+    vbl.request.sequence = 1;
+
+    int ret;
+    do {
+        ret = drmWaitVBlank(drm->fd, &vbl);
+    } while (ret && errno == EINTR);
+    if (ret) return -errno;
+
+    *timestamp = seconds_to_nanoseconds(vbl.reply.tval_sec) + us2ns(vbl.reply.tval_usec);
+    return 0;
+}
+
+static void drm_close(hwc_backend_t* be) {
+    drm_backend_t* drm = (drm_backend_t*)be->priv;
+
+    for (int i = 0; i < DRM_FB_CACHE_SIZE; i++) {
+        if (drm->fbs[i].fb_id) drmModeRmFB(drm->fd, drm->fbs[i].fb_id);
+    }
+    for (int i = 0; i < DRM_MAX_DISPLAYS; i++) {
+        drm_flight_clear(&drm->displays[i]);
+        if (drm->displays[i].mode_blob) drmModeDestroyPropertyBlob(drm->fd, drm->displays[i].mode_blob);
+    }
+    pthread_mutex_destroy(&drm->lock);
+    close(drm->fd);
+    free(drm);
+    be->priv = NULL;
+}
+
+static const hwc_backend_ops_t drm_backend_ops = {
+    name: "drm",
+    close: drm_close,
+    init_display: drm_init_display,
+    get_mode: drm_get_mode,
+    caps: drm_caps,
+    test: drm_test,
+    post: drm_post,
+    set_cursor: drm_set_cursor,
+    set_cursor_pos: drm_set_cursor_pos,
+    wait_vblank: drm_wait_vblank,
+};
+
+int drm_backend_open(hwc_backend_t* be) {
+    char path[PROPERTY_VALUE_MAX];
+
+    property_get(HWC_DRM_PROP_DEVICE, path, HWC_DRM_DEFAULT_DEVICE);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        ALOGE("drm: open %s fail: %s", path, strerror(errno));
+        return -errno;
+    }
+
+    if (drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1)
+        || drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+        ALOGE("drm: %s has no atomic modesetting", path);
+        close(fd);
+        return -ENOTSUP;
+    }
+
+    drm_backend_t* drm = (drm_backend_t*)calloc(1, sizeof(drm_backend_t));
+    if (!drm) {
+        close(fd);
+        return -ENOMEM;
+    }
+    drm->fd = fd;
+    pthread_mutex_init(&drm->lock, NULL);
+
+    be->ops = &drm_backend_ops;
+    be->priv = drm;
+    ALOGI("drm: using %s", path);
+    return 0;
+}
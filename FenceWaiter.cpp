@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <utils/Timers.h>
+
+#include "FenceWaiter.h"
+
+int hwc_fence_waiter_init(hwc_fence_waiter_t* waiter, int timeout_ms) {
+    memset(waiter, 0, sizeof(hwc_fence_waiter_t));
+    if (pipe2(waiter->wake, O_NONBLOCK | O_CLOEXEC)) return -errno;
+    pthread_mutex_init(&waiter->lock, NULL);
+    waiter->timeout_ms = timeout_ms;
+    return 0;
+}
+
+static void hwc_fence_waiter_wake(hwc_fence_waiter_t* waiter) {
+    char c = 0;
+    //EAGAIN is a full pipe, a wakeup is pending already.
+    (void)write(waiter->wake[1], &c, 1);
+}
+
+void hwc_fence_waiter_stop(hwc_fence_waiter_t* waiter) {
+    pthread_mutex_lock(&waiter->lock);
+    waiter->quit = true;
+    pthread_mutex_unlock(&waiter->lock);
+    hwc_fence_waiter_wake(waiter);
+}
+
+void hwc_fence_waiter_destroy(hwc_fence_waiter_t* waiter) {
+    for (int i = 0; i < waiter->count; i++) close(waiter->watches[i].fence.fd);
+    waiter->count = 0;
+    close(waiter->wake[0]);
+    close(waiter->wake[1]);
+    pthread_mutex_destroy(&waiter->lock);
+}
+
+int hwc_fence_watch(hwc_fence_waiter_t* waiter, int fd, int64_t start,
+        hwc_fence_done_t done, void* data) {
+    pthread_mutex_lock(&waiter->lock);
+    if (waiter->count == HWC_FENCE_WATCH_MAX || waiter->quit) {
+        pthread_mutex_unlock(&waiter->lock);
+        close(fd);
+        return -1;
+    }
+    hwc_fence_watch_t* watch = &waiter->watches[waiter->count++];
+    watch->fence.fd = fd;
+    watch->fence.status = HWC_FENCE_PENDING;
+    watch->fence.wait_ns = 0;
+    watch->start = start;
+    watch->expired = false;
+    watch->done = done;
+    watch->data = data;
+    pthread_mutex_unlock(&waiter->lock);
+
+    hwc_fence_waiter_wake(waiter);
+    return 0;
+}
+
+void hwc_fence_waiter_run(hwc_fence_waiter_t* waiter) {
+    struct pollfd fds[HWC_FENCE_WATCH_MAX + 1];
+    hwc_fence_watch_t reports[HWC_FENCE_WATCH_MAX];
+
+    pthread_mutex_lock(&waiter->lock);
+    while (!waiter->quit) {
+        int count = waiter->count;
+        nsecs_t timeout_ns = ms2ns(waiter->timeout_ms);
+        nsecs_t now = systemTime(CLOCK_MONOTONIC);
+        int timeout = -1;
+
+        fds[0].fd = waiter->wake[0];
+        fds[0].events = POLLIN;
+        for (int i = 0; i < count; i++) {
+            hwc_fence_watch_t const* watch = &waiter->watches[i];
+            fds[i + 1].fd = watch->fence.fd;
+            fds[i + 1].events = POLLIN;
+            if (watch->expired || waiter->timeout_ms < 0) continue;
+            nsecs_t left = watch->start + timeout_ns - now;
+            int ms = left > 0 ? (int)((left + 999999) / 1000000) : 0;
+            if (timeout < 0 || ms < timeout) timeout = ms;
+        }
+        pthread_mutex_unlock(&waiter->lock);
+
+        int ret = poll(fds, count + 1, timeout);
+        now = systemTime(CLOCK_MONOTONIC);
+        if (ret > 0 && (fds[0].revents & POLLIN)) {
+            char buf[16];
+            while (read(waiter->wake[0], buf, sizeof(buf)) > 0);
+        }
+
+        pthread_mutex_lock(&waiter->lock);
+        //watches are only appended meanwhile, the first count are the ones polled.
+        int reported = 0, kept = 0;
+        for (int i = 0; i < count; i++) {
+            hwc_fence_watch_t* watch = &waiter->watches[i];
+            short revents = ret > 0 ? fds[i + 1].revents : 0;
+            if (revents & (POLLERR | POLLNVAL)) {
+                watch->fence.status = HWC_FENCE_ERROR;
+            } else if (revents & POLLIN) {
+                watch->fence.status = HWC_FENCE_SIGNALED;
+            } else if (!watch->expired && waiter->timeout_ms >= 0 && now - watch->start >= timeout_ns) {
+                watch->expired = true;
+                watch->fence.status = HWC_FENCE_TIMEOUT;
+            }
+            if (watch->fence.status != HWC_FENCE_PENDING) {
+                watch->fence.wait_ns = now - watch->start;
+                reports[reported++] = *watch;
+                watch->fence.status = HWC_FENCE_PENDING;
+                //a stuck fence is still watched, it may signal yet.
+                if (reports[reported - 1].fence.status != HWC_FENCE_TIMEOUT) continue;
+            }
+            waiter->watches[kept++] = *watch;
+        }
+        for (int i = count; i < waiter->count; i++) waiter->watches[kept++] = waiter->watches[i];
+        waiter->count = kept;
+        pthread_mutex_unlock(&waiter->lock);
+
+        for (int i = 0; i < reported; i++) {
+            reports[i].done(&reports[i]);
+            if (reports[i].fence.status != HWC_FENCE_TIMEOUT) close(reports[i].fence.fd);
+        }
+        pthread_mutex_lock(&waiter->lock);
+    }
+    pthread_mutex_unlock(&waiter->lock);
+}
+
+void hwc_fence_stats_add(hwc_fence_stats_t* stats, hwc_fence_wait_t const* fence) {
+    static const int64_t bounds_us[] = HWC_TELEMETRY_FENCE_BOUNDS_US;
+
+    if (fence->status == HWC_FENCE_TIMEOUT) {
+        stats->timeouts++;
+        return;
+    }
+    stats->blocked++;
+    if (fence->status == HWC_FENCE_ERROR) stats->errors++;
+    if (fence->wait_ns > stats->max_ns) stats->max_ns = fence->wait_ns;
+    int bucket = 0;
+    while (bucket < HWC_TELEMETRY_FENCE_BUCKETS - 1 && fence->wait_ns >= us2ns(bounds_us[bucket])) bucket++;
+    stats->hist[bucket]++;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HWC_FENCE_WAITER_H
+#define HWC_FENCE_WAITER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "Telemetry.h"
+
+/*
+Watches acquire fences the display driver was handed along with their
+buffer. hwc_set only looks at a fence, the driver waits for it; the
+waiter thread polls every fence still pending at once, one wake pipe
+among them, to time them and to tell when one has been pending longer
+than the timeout, a gpu that is stuck or gone.
+*/
+
+//ms a fence may stay pending before it counts as stuck, -1 for never.
+#define HWC_PROP_FENCE_TIMEOUT  "persist.sys.hwc.fence_timeout"
+#define HWC_FENCE_TIMEOUT_MS    500
+
+//a few frames of each display.
+#define HWC_FENCE_WATCH_MAX     16
+
+enum {
+    HWC_FENCE_SIGNALED = 0,
+    HWC_FENCE_PENDING,
+    //signaled with an error, the gpu never finished the buffer.
+    HWC_FENCE_ERROR,
+    HWC_FENCE_TIMEOUT,
+};
+
+typedef struct hwc_fence_wait_t {
+    int fd;
+    int status;
+    //from the post until it signaled, or until it was found stuck.
+    int64_t wait_ns;
+} hwc_fence_wait_t;
+
+typedef struct hwc_fence_stats_t {
+    //fences posted, owned by the posting thread.
+    uint32_t waits;
+    //those still pending when posted, the rest is owned by the waiter thread.
+    uint32_t blocked;
+    uint32_t timeouts;
+    uint32_t errors;
+    int64_t max_ns;
+    //blocked fences by time to signal, bounds HWC_TELEMETRY_FENCE_BOUNDS_US.
+    uint32_t hist[HWC_TELEMETRY_FENCE_BUCKETS];
+} hwc_fence_stats_t;
+
+struct hwc_fence_watch_t;
+/*
+Called on the waiter thread with status HWC_FENCE_TIMEOUT once the fence
+is stuck, it stays watched, and with HWC_FENCE_SIGNALED or
+HWC_FENCE_ERROR when it is done.
+*/
+typedef void (*hwc_fence_done_t)(struct hwc_fence_watch_t const* watch);
+
+typedef struct hwc_fence_watch_t {
+    hwc_fence_wait_t fence;
+    int64_t start;
+    //the timeout was reported.
+    bool expired;
+    hwc_fence_done_t done;
+    void* data;
+} hwc_fence_watch_t;
+
+typedef struct hwc_fence_waiter_t {
+    pthread_mutex_t lock;
+    //written to when a fence is added or the thread has to quit.
+    int wake[2];
+    bool quit;
+    int timeout_ms;
+    int count;
+    hwc_fence_watch_t watches[HWC_FENCE_WATCH_MAX];
+} hwc_fence_waiter_t;
+
+int hwc_fence_waiter_init(hwc_fence_waiter_t* waiter, int timeout_ms);
+//the waiter thread, returns after hwc_fence_waiter_stop().
+void hwc_fence_waiter_run(hwc_fence_waiter_t* waiter);
+void hwc_fence_waiter_stop(hwc_fence_waiter_t* waiter);
+//after the thread is joined, closes what is still watched without reporting it.
+void hwc_fence_waiter_destroy(hwc_fence_waiter_t* waiter);
+
+/*
+Watch fd, which the waiter takes and closes, from start on. Returns -1
+and closes fd when the waiter is full.
+*/
+int hwc_fence_watch(hwc_fence_waiter_t* waiter, int fd, int64_t start,
+        hwc_fence_done_t done, void* data);
+
+//account a fence the waiter reported.
+void hwc_fence_stats_add(hwc_fence_stats_t* stats, hwc_fence_wait_t const* fence);
+
+#endif
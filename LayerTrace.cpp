@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "HWComposer"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <utils/Timers.h>
+
+// for private_handle_t
+#include <gralloc_priv.h>
+
+#include "LayerTrace.h"
+
+int hwc_trace_open(hwc_trace_t *trace, uint32_t xres, uint32_t yres, int32_t vsync_period) {
+    char val[PROPERTY_VALUE_MAX];
+    char path[PROPERTY_VALUE_MAX];
+
+    trace->fd = -1;
+    trace->seq = 0;
+    trace->buf = NULL;
+    trace->buf_size = 0;
+
+    memset(val, 0, sizeof(val));
+    if (!property_get(HWC_TRACE_PROP_ENABLE, val, "false") || strcmp(val, "true") != 0) {
+        return 0;
+    }
+
+    property_get(HWC_TRACE_PROP_PATH, path, HWC_TRACE_DEFAULT_PATH);
+    trace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace->fd < 0) {
+        ALOGE("open trace file (%s) fail: %s", path, strerror(errno));
+        return -errno;
+    }
+
+    hwc_trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = HWC_TRACE_MAGIC;
+    header.version = HWC_TRACE_VERSION;
+    header.header_size = sizeof(hwc_trace_header_t);
+    header.frame_size = sizeof(hwc_trace_frame_t);
+    header.display_size = sizeof(hwc_trace_display_t);
+    header.layer_size = sizeof(hwc_trace_layer_t);
+    header.start_time = systemTime(CLOCK_MONOTONIC);
+    header.xres = xres;
+    header.yres = yres;
+    header.vsync_period = vsync_period;
+
+    if (write(trace->fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        ALOGE("write trace header fail: %s", strerror(errno));
+        hwc_trace_close(trace);
+        return -EIO;
+    }
+
+    ALOGI("layer trace recording to %s", path);
+    return 0;
+}
+
+static void trace_layer(hwc_trace_layer_t *t, hwc_layer_1_t const* l) {
+    memset(t, 0, sizeof(*t));
+    t->composition_type = l->compositionType;
+    t->hints = l->hints;
+    t->flags = l->flags;
+
+    //the color only shares its storage with the handle, fences and damage are still there.
+    if (l->compositionType != HWC_BACKGROUND) {
+        t->transform = l->transform;
+        t->blending = l->blending;
+        t->plane_alpha = l->planeAlpha;
+        t->source_crop = l->sourceCropf;
+        t->display_frame = l->displayFrame;
+    }
+
+    if (l->acquireFenceFd >= 0) t->trace_flags |= HWC_TRACE_LAYER_ACQUIRE_FENCE;
+    if (l->releaseFenceFd >= 0) t->trace_flags |= HWC_TRACE_LAYER_RELEASE_FENCE;
+
+    //the true count, the replayer reports layers it got fewer rects for.
+    t->num_damage = l->surfaceDamage.numRects;
+    size_t n = t->num_damage;
+    if (n > HWC_TRACE_MAX_DAMAGE_RECTS) {
+        n = HWC_TRACE_MAX_DAMAGE_RECTS;
+        t->trace_flags |= HWC_TRACE_LAYER_DAMAGE_TRUNCATED;
+    }
+    if (n > 0 && l->surfaceDamage.rects) {
+        memcpy(t->damage, l->surfaceDamage.rects, n * sizeof(hwc_rect_t));
+    }
+
+    if (l->compositionType == HWC_BACKGROUND) {
+        t->background_color = (l->backgroundColor.r << 24) | (l->backgroundColor.g << 16)
+                | (l->backgroundColor.b << 8) | l->backgroundColor.a;
+        return;
+    }
+
+    if (l->compositionType == HWC_SIDEBAND) {
+        t->trace_flags |= HWC_TRACE_LAYER_SIDEBAND;
+        t->handle_id = (uint64_t)(uintptr_t)l->sidebandStream;
+        return;
+    }
+
+    if (!l->handle) return;
+
+    t->trace_flags |= HWC_TRACE_LAYER_HAS_HANDLE;
+    t->handle_id = (uint64_t)(uintptr_t)l->handle;
+    if (private_handle_t::validate(l->handle) < 0) return;
+
+    private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(l->handle);
+    t->trace_flags |= HWC_TRACE_LAYER_PRIVATE_HANDLE;
+    t->priv_flags = hnd->flags;
+    t->format = hnd->format;
+    t->width = hnd->width;
+    t->height = hnd->height;
+    t->stride = hnd->stride;
+    t->size = hnd->size;
+    t->usage = hnd->usage;
+}
+
+void hwc_trace_record(hwc_trace_t *trace, uint32_t call,
+        size_t numDisplays, hwc_display_contents_1_t** displays) {
+    if (!hwc_trace_enabled(trace) || !displays) return;
+
+    size_t size = sizeof(hwc_trace_frame_t);
+    for (size_t i = 0; i < numDisplays; i++) {
+        size += sizeof(hwc_trace_display_t);
+        if (displays[i]) size += displays[i]->numHwLayers * sizeof(hwc_trace_layer_t);
+    }
+
+    //grow only, steady state does a single write per call and no allocation.
+    if (size > trace->buf_size) {
+        char *buf = (char *)realloc(trace->buf, size);
+        if (!buf) return;
+        trace->buf = buf;
+        trace->buf_size = size;
+    }
+
+    char *p = trace->buf;
+    hwc_trace_frame_t *frame = (hwc_trace_frame_t *)p;
+    frame->call = call;
+    frame->seq = trace->seq++;
+    frame->timestamp = systemTime(CLOCK_MONOTONIC);
+    frame->num_displays = numDisplays;
+    frame->size = size;
+    p += sizeof(hwc_trace_frame_t);
+
+    for (size_t i = 0; i < numDisplays; i++) {
+        hwc_display_contents_1_t *contents = displays[i];
+        hwc_trace_display_t *d = (hwc_trace_display_t *)p;
+        memset(d, 0, sizeof(*d));
+        d->disp = i;
+        p += sizeof(hwc_trace_display_t);
+        if (!contents) continue;
+
+        d->present = 1;
+        d->flags = contents->flags;
+        d->num_layers = contents->numHwLayers;
+        d->has_retire_fence = contents->retireFenceFd >= 0;
+        d->has_outbuf_fence = (i == HWC_DISPLAY_VIRTUAL) && contents->outbufAcquireFenceFd >= 0;
+
+        for (size_t j = 0; j < contents->numHwLayers; j++) {
+            trace_layer((hwc_trace_layer_t *)p, &contents->hwLayers[j]);
+            p += sizeof(hwc_trace_layer_t);
+        }
+    }
+
+    if (write(trace->fd, trace->buf, size) != (ssize_t)size) {
+        ALOGE("write layer trace fail: %s, stop recording", strerror(errno));
+        hwc_trace_close(trace);
+    }
+}
+
+void hwc_trace_close(hwc_trace_t *trace) {
+    if (trace->fd >= 0) {
+        close(trace->fd);
+        trace->fd = -1;
+    }
+    free(trace->buf);
+    trace->buf = NULL;
+    trace->buf_size = 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HWC_LAYER_TRACE_H
+#define HWC_LAYER_TRACE_H
+
+#include <stdint.h>
+#include <hardware/hwcomposer.h>
+
+/*
+Binary layer-stack trace.
+
+The file is a hwc_trace_header_t followed by a sequence of frames. Every
+frame is a hwc_trace_frame_t, then for each display a hwc_trace_display_t
+followed by its hwc_trace_layer_t records. All records are fixed size and
+naturally aligned so a trace can be mmap'ed and walked in place, using
+hwc_trace_frame_t.size to step to the next frame.
+*/
+
+#define HWC_TRACE_MAGIC             0x54435748  /* "HWCT" */
+#define HWC_TRACE_VERSION           1
+#define HWC_TRACE_MAX_DAMAGE_RECTS  4
+
+#define HWC_TRACE_PROP_ENABLE       "sys.hwc.trace.record"
+#define HWC_TRACE_PROP_PATH         "sys.hwc.trace.path"
+#define HWC_TRACE_DEFAULT_PATH      "/data/local/tmp/hwc_trace.bin"
+
+enum {
+    HWC_TRACE_CALL_PREPARE = 1,
+    HWC_TRACE_CALL_SET     = 2,
+};
+
+enum {
+    HWC_TRACE_LAYER_HAS_HANDLE        = 1 << 0,
+    HWC_TRACE_LAYER_PRIVATE_HANDLE    = 1 << 1,
+    HWC_TRACE_LAYER_SIDEBAND          = 1 << 2,
+    HWC_TRACE_LAYER_ACQUIRE_FENCE     = 1 << 3,
+    HWC_TRACE_LAYER_RELEASE_FENCE     = 1 << 4,
+    HWC_TRACE_LAYER_DAMAGE_TRUNCATED  = 1 << 5,
+};
+
+typedef struct hwc_trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t frame_size;
+    uint32_t display_size;
+    uint32_t layer_size;
+    int64_t  start_time;
+    //primary display as seen when recording started, replay fakes it.
+    uint32_t xres;
+    uint32_t yres;
+    int32_t  vsync_period;
+    uint32_t reserved;
+} hwc_trace_header_t;
+
+typedef struct hwc_trace_frame {
+    uint32_t call;
+    uint32_t seq;
+    int64_t  timestamp;
+    uint32_t num_displays;
+    //bytes of this frame including all display and layer records.
+    uint32_t size;
+} hwc_trace_frame_t;
+
+typedef struct hwc_trace_display {
+    int32_t  disp;
+    uint32_t present;
+    uint32_t flags;
+    uint32_t num_layers;
+    int32_t  has_retire_fence;
+    int32_t  has_outbuf_fence;
+} hwc_trace_display_t;
+
+typedef struct hwc_trace_layer {
+    int32_t  composition_type;
+    uint32_t hints;
+    uint32_t flags;
+    uint32_t trace_flags;
+    uint64_t handle_id;
+    int32_t  priv_flags;
+    int32_t  format;
+    int32_t  width;
+    int32_t  height;
+    int32_t  stride;
+    int32_t  size;
+    int32_t  usage;
+    uint32_t transform;
+    int32_t  blending;
+    uint32_t plane_alpha;
+    uint32_t background_color;
+    hwc_frect_t source_crop;
+    hwc_rect_t  display_frame;
+    //rects SurfaceFlinger passed, only the first HWC_TRACE_MAX_DAMAGE_RECTS are
+    //kept and HWC_TRACE_LAYER_DAMAGE_TRUNCATED is set beyond that.
+    uint32_t num_damage;
+    hwc_rect_t  damage[HWC_TRACE_MAX_DAMAGE_RECTS];
+} hwc_trace_layer_t;
+
+typedef struct hwc_trace {
+    int fd;
+    uint32_t seq;
+    char *buf;
+    size_t buf_size;
+} hwc_trace_t;
+
+/* open the trace file if HWC_TRACE_PROP_ENABLE is set, fd stays -1 otherwise. */
+int hwc_trace_open(hwc_trace_t *trace, uint32_t xres, uint32_t yres, int32_t vsync_period);
+void hwc_trace_record(hwc_trace_t *trace, uint32_t call,
+        size_t numDisplays, hwc_display_contents_1_t** displays);
+void hwc_trace_close(hwc_trace_t *trace);
+
+static inline bool hwc_trace_enabled(const hwc_trace_t *trace) {
+    return trace->fd >= 0;
+}
+
+#endif
@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//#define LOG_NDEBUG 0
+#define LOG_TAG "HWComposer"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <cutils/ashmem.h>
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+#include <cutils/properties.h>
+#include <cutils/sockets.h>
+#include <private/android_filesystem_config.h>
+
+#include "Telemetry.h"
+
+static size_t telemetry_page_size() {
+    size_t page_size = getpagesize();
+    return (sizeof(hwc_telemetry_page_t) + page_size - 1) & ~(page_size - 1);
+}
+
+//the fd travels once per connection, the agent maps the page and hangs up.
+static void telemetry_send_fd(int conn, int fd) {
+    struct msghdr msg;
+    struct iovec iov;
+    char cmsg_buf[CMSG_SPACE(sizeof(int))];
+    char dummy = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(cmsg_buf, 0, sizeof(cmsg_buf));
+    iov.iov_base = &dummy;
+    iov.iov_len = sizeof(dummy);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) < 0) {
+        ALOGW("telemetry: send fd fail: %s", strerror(errno));
+    }
+}
+
+//abstract sockets have no permissions, the peer's uid is all there is to go by.
+static bool telemetry_peer_allowed(hwc_telemetry_t* telemetry, int conn) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        ALOGW("telemetry: no peer credentials: %s", strerror(errno));
+        return false;
+    }
+    if (cred.uid == AID_ROOT || cred.uid == AID_SYSTEM
+        || (telemetry->agent_uid >= 0 && cred.uid == (uid_t)telemetry->agent_uid)) {
+        return true;
+    }
+    ALOGW("telemetry: refused pid %d uid %d", cred.pid, cred.uid);
+    return false;
+}
+
+static void *telemetry_thread(void *data) {
+    hwc_telemetry_t* telemetry = (hwc_telemetry_t*)data;
+
+    while (android_atomic_acquire_load(&telemetry->running)) {
+        int conn = accept(telemetry->sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            //the socket was shut down by hwc_telemetry_close().
+            break;
+        }
+        if (telemetry_peer_allowed(telemetry, conn)) telemetry_send_fd(conn, telemetry->fd);
+        close(conn);
+    }
+    return NULL;
+}
+
+int hwc_telemetry_open(hwc_telemetry_t* telemetry) {
+    char val[PROPERTY_VALUE_MAX];
+
+    telemetry->fd = -1;
+    telemetry->page = NULL;
+    telemetry->sock = -1;
+    telemetry->running = 0;
+    telemetry->agent_uid = -1;
+
+    memset(val, 0, sizeof(val));
+    if (!property_get(HWC_TELEMETRY_PROP_ENABLE, val, "false") || strcmp(val, "true") != 0) {
+        return 0;
+    }
+
+    if (property_get(HWC_TELEMETRY_PROP_UID, val, NULL) > 0) telemetry->agent_uid = atoi(val);
+
+    size_t size = telemetry_page_size();
+    telemetry->fd = ashmem_create_region("hwc-telemetry", size);
+    if (telemetry->fd < 0) {
+        ALOGE("telemetry: create region fail: %s", strerror(errno));
+        return -errno;
+    }
+
+    void* page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, telemetry->fd, 0);
+    if (page == MAP_FAILED) {
+        ALOGE("telemetry: mmap fail: %s", strerror(errno));
+        hwc_telemetry_close(telemetry);
+        return -ENOMEM;
+    }
+    telemetry->page = (hwc_telemetry_page_t*)page;
+    memset(page, 0, size);
+    telemetry->page->magic = HWC_TELEMETRY_MAGIC;
+    telemetry->page->version = HWC_TELEMETRY_VERSION;
+    telemetry->page->size = sizeof(hwc_telemetry_page_t);
+
+    //our own mapping stays writable, everyone else can only map it read-only.
+    if (ashmem_set_prot_region(telemetry->fd, PROT_READ) < 0) {
+        ALOGE("telemetry: set read-only fail: %s", strerror(errno));
+        hwc_telemetry_close(telemetry);
+        return -EPERM;
+    }
+
+    telemetry->sock = socket_local_server(HWC_TELEMETRY_SOCKET,
+            ANDROID_SOCKET_NAMESPACE_ABSTRACT, SOCK_STREAM);
+    if (telemetry->sock < 0) {
+        ALOGE("telemetry: listen on %s fail", HWC_TELEMETRY_SOCKET);
+        hwc_telemetry_close(telemetry);
+        return -EIO;
+    }
+
+    android_atomic_release_store(1, &telemetry->running);
+    if (pthread_create(&telemetry->thread, NULL, telemetry_thread, telemetry)) {
+        ALOGE("telemetry: create thread fail");
+        android_atomic_release_store(0, &telemetry->running);
+        hwc_telemetry_close(telemetry);
+        return -EAGAIN;
+    }
+
+    ALOGI("telemetry page served on @%s", HWC_TELEMETRY_SOCKET);
+    return 0;
+}
+
+void hwc_telemetry_close(hwc_telemetry_t* telemetry) {
+    if (android_atomic_acquire_load(&telemetry->running)) {
+        android_atomic_release_store(0, &telemetry->running);
+        shutdown(telemetry->sock, SHUT_RDWR);
+        pthread_join(telemetry->thread, NULL);
+    }
+    if (telemetry->sock >= 0) {
+        close(telemetry->sock);
+        telemetry->sock = -1;
+    }
+    if (telemetry->page) {
+        munmap(telemetry->page, telemetry_page_size());
+        telemetry->page = NULL;
+    }
+    if (telemetry->fd >= 0) {
+        close(telemetry->fd);
+        telemetry->fd = -1;
+    }
+}
+
+/*
+Single writer per section: odd count, copy, even count. A reader that sees
+an odd or changed count retries, the writer never waits for it.
+*/
+static void telemetry_publish(volatile int32_t* seq, void* dst, void const* src, size_t size) {
+    int32_t s = *seq;
+
+    android_atomic_release_store(s + 1, seq);
+    android_memory_barrier();
+    memcpy(dst, src, size);
+    android_atomic_release_store(s + 2, seq);
+}
+
+void hwc_telemetry_publish_vsync(hwc_telemetry_t* telemetry, hwc_telemetry_vsync_t const* vsync) {
+    if (!hwc_telemetry_enabled(telemetry)) return;
+    hwc_telemetry_page_t* page = telemetry->page;
+    telemetry_publish(&page->vsync_seq, &page->vsync, vsync, sizeof(hwc_telemetry_vsync_t));
+}
+
+void hwc_telemetry_publish_frames(hwc_telemetry_t* telemetry, hwc_telemetry_frames_t const* frames) {
+    if (!hwc_telemetry_enabled(telemetry)) return;
+    hwc_telemetry_page_t* page = telemetry->page;
+    telemetry_publish(&page->frames_seq, &page->frames, frames, sizeof(hwc_telemetry_frames_t));
+}
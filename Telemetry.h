@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HWC_TELEMETRY_H
+#define HWC_TELEMETRY_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+Live HAL counters in one ashmem page, for monitoring agents that can't
+afford dumpsys. An agent connects to the abstract unix socket
+HWC_TELEMETRY_SOCKET and gets the page fd back as SCM_RIGHTS. Only root,
+system and the uid in HWC_TELEMETRY_PROP_UID get it, anyone else is hung
+up on. The fd can only be mapped read-only, and the HAL never blocks on
+its readers.
+
+The vsync and frame sections have one writer each, the vsync thread and
+hwc_set, and are published under their own sequence count. To read a
+section:
+
+    do {
+        seq = section seq;              //retry while odd
+        copy the section;
+    } while (seq is odd || seq != section seq);
+
+with read barriers around the copy.
+*/
+
+#define HWC_TELEMETRY_PROP_ENABLE   "persist.sys.hwc.telemetry"
+#define HWC_TELEMETRY_PROP_UID      "persist.sys.hwc.telemetry.uid"
+#define HWC_TELEMETRY_SOCKET        "hwc_telemetry"
+
+#define HWC_TELEMETRY_MAGIC         0x4d435748  /* "HWCM" */
+#define HWC_TELEMETRY_VERSION       4
+#define HWC_TELEMETRY_DISPLAYS      2
+
+//vsync thread wakeup lateness buckets, upper bounds in us. The last bucket is open.
+#define HWC_TELEMETRY_WAKE_BUCKETS  8
+#define HWC_TELEMETRY_WAKE_BOUNDS_US { 50, 100, 200, 500, 1000, 2000, 5000 }
+
+//acquire fence waits that blocked, upper bounds in us. The last bucket is open.
+#define HWC_TELEMETRY_FENCE_BUCKETS 8
+#define HWC_TELEMETRY_FENCE_BOUNDS_US { 500, 1000, 2000, 4000, 8000, 16000, 33000 }
+
+//written by the vsync thread on every vsync it delivers.
+typedef struct hwc_telemetry_vsync_t {
+    uint64_t count;
+    //last vsync delivered, 0 while vsync is off.
+    int64_t timestamp;
+    //distance of the last interval between wakeups from the vsync period.
+    int64_t jitter_ns;
+    int64_t jitter_max_ns;
+    //vsyncs no event was seen for while SurfaceFlinger had vsync on.
+    uint64_t missed;
+    //video axis updates applied.
+    uint64_t overlay_updates;
+    //how long after the vsync edge the thread got to run, since version 2.
+    int64_t wake_max_ns;
+    uint32_t wake_hist[HWC_TELEMETRY_WAKE_BUCKETS];
+} hwc_telemetry_vsync_t;
+
+typedef struct hwc_telemetry_display_t {
+    uint32_t connected;
+    uint32_t xres;
+    uint32_t yres;
+    uint32_t out_xres;
+    uint32_t out_yres;
+    int32_t vsync_period;
+    uint64_t frames_posted;
+    //frames that never reached the screen: afbc drops and failed posts.
+    uint64_t frames_skipped;
+    uint32_t scan_bytes;
+    //framebuffer targets that came back while still held by the display, since version 3.
+    uint32_t fb_stalls;
+    //acquire fences of posted frames, since version 4.
+    uint32_t fence_timeouts;
+    int64_t fence_wait_max_ns;
+    uint32_t fence_hist[HWC_TELEMETRY_FENCE_BUCKETS];
+} hwc_telemetry_display_t;
+
+//written at the end of every hwc_set.
+typedef struct hwc_telemetry_frames_t {
+    uint64_t count;
+    int64_t set_time;
+    int64_t prepare_ns;
+    //posts that found their acquire fence not yet signaled.
+    uint64_t fence_waits;
+    //acquire fences found pending past the timeout, all displays.
+    uint64_t fence_timeouts;
+    hwc_telemetry_display_t displays[HWC_TELEMETRY_DISPLAYS];
+} hwc_telemetry_frames_t;
+
+typedef struct hwc_telemetry_page_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t reserved;
+    //the two writers stay off each other's cache lines.
+    volatile int32_t vsync_seq __attribute__((aligned(64)));
+    hwc_telemetry_vsync_t vsync;
+    volatile int32_t frames_seq __attribute__((aligned(64)));
+    hwc_telemetry_frames_t frames;
+} hwc_telemetry_page_t;
+
+typedef struct hwc_telemetry_t {
+    int fd;
+    hwc_telemetry_page_t* page;
+    int sock;
+    //HWC_TELEMETRY_PROP_UID, -1 if unset.
+    int agent_uid;
+    //cleared by hwc_telemetry_close() while the server thread reads it.
+    volatile int32_t running;
+    pthread_t thread;
+} hwc_telemetry_t;
+
+/* create the page and start serving it if HWC_TELEMETRY_PROP_ENABLE is set. */
+int hwc_telemetry_open(hwc_telemetry_t* telemetry);
+void hwc_telemetry_close(hwc_telemetry_t* telemetry);
+
+static inline bool hwc_telemetry_enabled(hwc_telemetry_t* telemetry) {
+    return telemetry->page != NULL;
+}
+
+void hwc_telemetry_publish_vsync(hwc_telemetry_t* telemetry, hwc_telemetry_vsync_t const* vsync);
+void hwc_telemetry_publish_frames(hwc_telemetry_t* telemetry, hwc_telemetry_frames_t const* frames);
+
+#endif
@@ -0,0 +1,47 @@
+LOCAL_PATH:= $(call my-dir)
+
+# One hwc_bench per product policy (see DisplayPolicy.h), so a change can be
+# measured on the configurations it specializes:
+#   hwc_bench           primary only
+#   hwc_bench_ext       primary plus hotplugged external display
+#   hwc_bench_fb1       external display on fb1, no cursor osd
+#   hwc_bench_hwvsync   vsync from the osd instead of the software timer
+HWC_BENCH_VARIANTS := hwc_bench hwc_bench_ext hwc_bench_fb1 hwc_bench_hwvsync
+HWC_BENCH_FLAGS_hwc_bench :=
+HWC_BENCH_FLAGS_hwc_bench_ext := -DWITH_EXTERNAL_DISPLAY
+HWC_BENCH_FLAGS_hwc_bench_fb1 := -DWITH_EXTERNAL_DISPLAY -DSINGLE_EXTERNAL_DISPLAY_USE_FB1
+HWC_BENCH_FLAGS_hwc_bench_hwvsync := -DUSE_HW_VSYNC
+
+MESON_GRALLOC_DIR ?= hardware/amlogic/gralloc
+
+define hwc-bench-variant
+include $(CLEAR_VARS)
+
+# hwcomposer.cpp is included by hwc_bench.cpp, on the fake framebuffer of hwc_replay.
+LOCAL_SRC_FILES:=                     \
+        hwc_bench.cpp          \
+        ../replay/FakeFramebuffer.cpp \
+        ../LayerTrace.cpp      \
+        ../BufferCache.cpp     \
+        ../Telemetry.cpp       \
+        ../CostModel.cpp       \
+        ../FenceWaiter.cpp     \
+
+LOCAL_C_INCLUDES := \
+        $(LOCAL_PATH)/..       \
+        $(LOCAL_PATH)/../replay \
+        $(MESON_GRALLOC_DIR)
+
+LOCAL_SHARED_LIBRARIES := liblog libEGL libutils libcutils libhardware libsync libhardware_legacy
+LOCAL_STATIC_LIBRARIES := libomxutil
+LOCAL_CFLAGS += -DMALI_AFBC_GRALLOC=$(HWC_MALI_AFBC_GRALLOC)
+LOCAL_CFLAGS += $(HWC_BENCH_FLAGS_$(1))
+LOCAL_CFLAGS += -DLOG_TAG=\"hwc_bench\"
+
+LOCAL_MODULE:= $(1)
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
+endef
+
+$(foreach v,$(HWC_BENCH_VARIANTS),$(eval $(call hwc-bench-variant,$(v))))
@@ -0,0 +1,82 @@
+#!/usr/bin/env python
+#
+# Copyright (C) 2010 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Compare two hwc_bench runs.
+
+usage: compare.py [-t percent] [-m metric] baseline.json current.json
+
+Exits 1 if any benchmark present in both runs got slower than the baseline
+by more than the threshold (default 10%) on the metric (default p50_ns).
+Benchmarks only one side has are listed but never fail the run. Runs of
+binaries built with different policies (context.config) are compared with
+a warning, their numbers are not expected to match.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        run = json.load(f)
+    config = run.get("context", {}).get("config", {})
+    return dict((b["name"], b) for b in run["benchmarks"]), config
+
+
+def main():
+    parser = argparse.ArgumentParser(description="compare two hwc_bench runs")
+    parser.add_argument("-t", "--threshold", type=float, default=10.0,
+                        help="allowed slowdown in percent")
+    parser.add_argument("-m", "--metric", default="p50_ns",
+                        help="result field to compare")
+    parser.add_argument("baseline")
+    parser.add_argument("current")
+    args = parser.parse_args()
+
+    base, base_config = load(args.baseline)
+    cur, cur_config = load(args.current)
+    regressions = 0
+
+    for key in sorted(set(base_config) | set(cur_config)):
+        if base_config.get(key) != cur_config.get(key):
+            print("warning: %s differs, baseline %s, current %s"
+                  % (key, base_config.get(key), cur_config.get(key)))
+
+    print("%-24s %12s %12s %8s" % ("benchmark", "baseline", "current", "change"))
+    for name in sorted(set(base) | set(cur)):
+        if name not in base or name not in cur:
+            print("%-24s %s" % (name, "only in current" if name in cur else "only in baseline"))
+            continue
+
+        b = base[name][args.metric]
+        c = cur[name][args.metric]
+        change = (c - b) * 100.0 / b if b else 0.0
+        mark = ""
+        if change > args.threshold:
+            mark = "  REGRESSION"
+            regressions += 1
+        print("%-24s %12d %12d %+7.1f%%%s" % (name, b, c, change, mark))
+
+    if regressions:
+        print("%d benchmark(s) slower than baseline by more than %.1f%%"
+              % (regressions, args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,529 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+hwc_bench: microbenchmarks of the HAL hot paths, run against the fake
+framebuffer devices of hwc_replay. The osds are never posted to, but the
+HAL still writes the vpp and osd sysfs nodes (video axis, test_screen,
+osd_afbcd, free_scale) and serves @hwc_telemetry if that is enabled. Run
+it with SurfaceFlinger stopped.
+
+  prepare/layers:N      hwc_prepare of N mixed layers plus the fb target
+  set/layers:N          hwc_set, i.e. fb_post, of the same frame
+  uevent/isMatch        parsing one hdmi switch uevent
+  output_mode/parse     chk_output_mode on a changed mode
+  omx_pts/scan:*        set_omx_pts on a foreign and on a tagged buffer
+  vsync/load:N          lateness of wait_next_vsync with N busy threads
+
+Every benchmark takes a number of samples, each timing a batch of calls,
+and reports ns per call. Results go to stdout (or -o) as JSON, with the
+hwc_policy the binary was built with; compare two runs with
+bench/compare.py. bench/Android.mk builds one binary per policy.
+
+usage: hwc_bench [-s samples] [-v vsyncs] [-f filter] [-o file] [-d tmpdir]
+*/
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <utils/Vector.h>
+
+#include "FakeFramebuffer.h"
+
+//the parsers under test are file-local.
+#include "hwcomposer.cpp"
+
+#define BENCH_MAX_LAYERS        64
+#define BENCH_DEFAULT_SAMPLES   200
+#define BENCH_DEFAULT_VSYNCS    120
+
+typedef struct bench_result_t {
+    char name[64];
+    uint32_t samples;
+    uint32_t ops_per_sample;
+    nsecs_t mean_ns;
+    nsecs_t min_ns;
+    nsecs_t p50_ns;
+    nsecs_t p99_ns;
+    nsecs_t max_ns;
+} bench_result_t;
+
+typedef struct bench_context_t {
+    hwc_composer_device_1_t *hwc;
+    uint32_t samples;
+    uint32_t vsyncs;
+    const char *filter;
+    const char *tmpdir;
+    android::Vector<bench_result_t> results;
+} bench_context_t;
+
+//called with ops, runs the code under test that many times.
+typedef void (*bench_fn_t)(void *arg, uint32_t ops);
+
+static int cmp_nsecs(const nsecs_t* a, const nsecs_t* b) {
+    return (*a > *b) - (*a < *b);
+}
+
+static void add_result(bench_context_t *bctx, const char *name,
+        android::Vector<nsecs_t>& v, uint32_t ops_per_sample) {
+    bench_result_t r;
+
+    memset(&r, 0, sizeof(r));
+    strncpy(r.name, name, sizeof(r.name) - 1);
+    r.samples = v.size();
+    r.ops_per_sample = ops_per_sample;
+    if (!v.isEmpty()) {
+        v.sort(cmp_nsecs);
+        nsecs_t total = 0;
+        for (size_t i = 0; i < v.size(); i++) total += v[i];
+        r.mean_ns = total / v.size();
+        r.min_ns = v[0];
+        r.p50_ns = v[v.size() / 2];
+        r.p99_ns = v[(v.size() * 99) / 100];
+        r.max_ns = v[v.size() - 1];
+    }
+    bctx->results.add(r);
+    fprintf(stderr, "%-24s mean=%lldns p50=%lldns p99=%lldns max=%lldns\n", r.name,
+            (long long)r.mean_ns, (long long)r.p50_ns, (long long)r.p99_ns, (long long)r.max_ns);
+}
+
+static bool selected(bench_context_t *bctx, const char *name) {
+    return !bctx->filter || strstr(name, bctx->filter);
+}
+
+static void run_bench(bench_context_t *bctx, const char *name, bench_fn_t fn, void *arg,
+        uint32_t ops_per_sample) {
+    android::Vector<nsecs_t> v;
+
+    if (!selected(bctx, name)) return;
+
+    //warm caches and the HAL's first-frame paths.
+    for (int i = 0; i < 3; i++) fn(arg, ops_per_sample);
+
+    for (uint32_t s = 0; s < bctx->samples; s++) {
+        nsecs_t start = systemTime(CLOCK_MONOTONIC);
+        fn(arg, ops_per_sample);
+        v.add((systemTime(CLOCK_MONOTONIC) - start) / ops_per_sample);
+    }
+    add_result(bctx, name, v, ops_per_sample);
+}
+
+/*
+prepare / set
+*/
+
+typedef struct frame_arg_t {
+    hwc_composer_device_1_t *hwc;
+    hwc_display_contents_1_t *contents;
+} frame_arg_t;
+
+static buffer_handle_t bench_handle(int flags, int format, int w, int h) {
+    private_handle_t *hnd = new private_handle_t(flags, 0, w * h * 4, 0, 0, -1, 0, 0);
+    hnd->format = format;
+    hnd->width = w;
+    hnd->height = h;
+    hnd->stride = w;
+    //untouched pages cost nothing, only cursor uploads read them.
+    void *base = mmap(NULL, hnd->size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    hnd->base = (base == MAP_FAILED) ? NULL : base;
+    return hnd;
+}
+
+static void set_rect(hwc_rect_t *r, int left, int top, int right, int bottom) {
+    r->left = left;
+    r->top = top;
+    r->right = right;
+    r->bottom = bottom;
+}
+
+/*
+A ui stack: full screen and windowed ui buffers, one video overlay, dims,
+and a cursor on top once there are enough layers for one.
+*/
+static hwc_display_contents_1_t* build_frame(size_t num_layers) {
+    int xres = fake_fb_xres, yres = fake_fb_yres;
+    hwc_display_contents_1_t *contents = (hwc_display_contents_1_t *)calloc(1,
+            sizeof(hwc_display_contents_1_t) + (num_layers + 1) * sizeof(hwc_layer_1_t));
+
+    contents->retireFenceFd = -1;
+    contents->flags = HWC_GEOMETRY_CHANGED;
+    contents->numHwLayers = num_layers + 1;
+
+    for (size_t j = 0; j <= num_layers; j++) {
+        hwc_layer_1_t *l = &contents->hwLayers[j];
+        l->compositionType = HWC_FRAMEBUFFER;
+        l->blending = HWC_BLENDING_PREMULT;
+        l->planeAlpha = 0xFF;
+        l->acquireFenceFd = -1;
+        l->releaseFenceFd = -1;
+        set_rect(&l->displayFrame, 0, 0, xres, yres);
+
+        if (j == num_layers) {
+            l->compositionType = HWC_FRAMEBUFFER_TARGET;
+            l->handle = bench_handle(private_handle_t::PRIV_FLAGS_FRAMEBUFFER,
+                    HAL_PIXEL_FORMAT_RGBA_8888, xres, yres);
+        } else if (num_layers >= 4 && j == num_layers - 1) {
+            l->flags = HWC_IS_CURSOR_LAYER;
+            l->handle = bench_handle(0, HAL_PIXEL_FORMAT_RGBA_8888, 64, 64);
+            set_rect(&l->displayFrame, xres / 2, yres / 2, xres / 2 + 64, yres / 2 + 64);
+        } else if (j % 4 == 0) {
+            l->handle = bench_handle(0, HAL_PIXEL_FORMAT_RGBA_8888, xres, yres);
+        } else if (j % 4 == 1) {
+            l->handle = bench_handle(0, HAL_PIXEL_FORMAT_RGBA_8888, xres / 2, yres / 2);
+            set_rect(&l->displayFrame, xres / 4, yres / 4, xres * 3 / 4, yres * 3 / 4);
+        } else if (j == 2) {
+            l->handle = bench_handle(private_handle_t::PRIV_FLAGS_VIDEO_OVERLAY,
+                    HAL_PIXEL_FORMAT_YV12, xres, yres);
+        } else if (j % 4 == 2) {
+            l->handle = bench_handle(0, HAL_PIXEL_FORMAT_RGBX_8888, xres / 4, yres / 4);
+            set_rect(&l->displayFrame, 0, 0, xres / 4, yres / 4);
+        }
+        //j % 4 == 3 stays a dim, a solid layer without buffer.
+        if (l->handle) {
+            private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(l->handle);
+            l->sourceCropf.right = hnd->width;
+            l->sourceCropf.bottom = hnd->height;
+        }
+    }
+    return contents;
+}
+
+static void free_frame(hwc_display_contents_1_t *contents) {
+    for (size_t j = 0; j < contents->numHwLayers; j++) {
+        private_handle_t *hnd = (private_handle_t *)contents->hwLayers[j].handle;
+        if (!hnd) continue;
+        if (hnd->base) munmap(hnd->base, hnd->size);
+        delete hnd;
+    }
+    free(contents);
+}
+
+static void close_fences(hwc_display_contents_1_t *contents) {
+    if (contents->retireFenceFd >= 0) close(contents->retireFenceFd);
+    contents->retireFenceFd = -1;
+    for (size_t j = 0; j < contents->numHwLayers; j++) {
+        hwc_layer_1_t *l = &contents->hwLayers[j];
+        if (l->releaseFenceFd >= 0) close(l->releaseFenceFd);
+        l->releaseFenceFd = -1;
+    }
+}
+
+//like SurfaceFlinger, layers are handed back as GLES only on geometry changes.
+static void bench_prepare(void *data, uint32_t ops) {
+    frame_arg_t *arg = (frame_arg_t *)data;
+    hwc_display_contents_1_t *contents = arg->contents;
+
+    for (uint32_t i = 0; i < ops; i++) {
+        for (size_t j = 0; (contents->flags & HWC_GEOMETRY_CHANGED) && j + 1 < contents->numHwLayers; j++) {
+            contents->hwLayers[j].compositionType = HWC_FRAMEBUFFER;
+            contents->hwLayers[j].hints = 0;
+        }
+        arg->hwc->prepare(arg->hwc, 1, &contents);
+        contents->flags = 0;
+    }
+}
+
+static void bench_set(void *data, uint32_t ops) {
+    frame_arg_t *arg = (frame_arg_t *)data;
+
+    for (uint32_t i = 0; i < ops; i++) {
+        arg->hwc->set(arg->hwc, 1, &arg->contents);
+        close_fences(arg->contents);
+    }
+}
+
+static void bench_frames(bench_context_t *bctx) {
+    char name[64];
+
+    for (size_t n = 1; n <= BENCH_MAX_LAYERS; n *= 2) {
+        frame_arg_t arg;
+        arg.hwc = bctx->hwc;
+        arg.contents = build_frame(n);
+
+        snprintf(name, sizeof(name), "prepare/layers:%zu", n);
+        run_bench(bctx, name, bench_prepare, &arg, 1);
+
+        //set works on the decisions of the last prepare.
+        arg.contents->flags = HWC_GEOMETRY_CHANGED;
+        bench_prepare(&arg, 1);
+        snprintf(name, sizeof(name), "set/layers:%zu", n);
+        run_bench(bctx, name, bench_set, &arg, 1);
+
+        free_frame(arg.contents);
+    }
+}
+
+/*
+parsers
+*/
+
+static void bench_is_match(void *data, uint32_t ops) {
+    hwc_uevent_data_t *u = (hwc_uevent_data_t *)data;
+
+    for (uint32_t i = 0; i < ops; i++) isMatch(u, HDMI_UEVENT);
+}
+
+static void bench_uevent(bench_context_t *bctx) {
+    static const char *fields[] = {
+        "change@/devices/virtual/switch/hdmi_audio",
+        "ACTION=change",
+        "DEVPATH=/devices/virtual/switch/hdmi_audio",
+        "SUBSYSTEM=switch",
+        "SWITCH_NAME=hdmi_audio",
+        "SWITCH_STATE=1",
+        "SEQNUM=2791",
+    };
+    hwc_uevent_data_t u;
+
+    memset(&u, 0, sizeof(u));
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        strcpy(u.buf + u.len, fields[i]);
+        u.len += strlen(fields[i]) + 1;
+    }
+    //the hotplug thread terminates the last field itself.
+    u.len--;
+    run_bench(bctx, "uevent/isMatch", bench_is_match, &u, 1000);
+}
+
+typedef struct mode_arg_t {
+    char path[PATH_MAX];
+} mode_arg_t;
+
+//curmode is cleared so every call parses a changed mode.
+static void bench_output_mode(void *data, uint32_t ops) {
+    mode_arg_t *arg = (mode_arg_t *)data;
+    char curmode[32];
+
+    for (uint32_t i = 0; i < ops; i++) {
+        curmode[0] = '\0';
+        chk_output_mode(arg->path, curmode);
+    }
+}
+
+static void bench_parsers(bench_context_t *bctx) {
+    bench_uevent(bctx);
+
+    mode_arg_t arg;
+    snprintf(arg.path, sizeof(arg.path), "%s/hwc_bench_mode", bctx->tmpdir);
+    int fd = open(arg.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || write(fd, "1080p50hz", 9) != 9) {
+        fprintf(stderr, "can't write %s, skip output_mode: %s\n", arg.path, strerror(errno));
+    } else {
+        run_bench(bctx, "output_mode/parse", bench_output_mode, &arg, 100);
+    }
+    if (fd >= 0) {
+        close(fd);
+        unlink(arg.path);
+    }
+}
+
+/*
+omx pts
+*/
+
+#define BENCH_OMX_BUFFER_SIZE   4096
+#define BENCH_OMX_SECRET        "amlogic_omx_decoder,pts="
+#define BENCH_OMX_RENDERED      "is rendered = true"
+
+typedef struct omx_arg_t {
+    char data[BENCH_OMX_BUFFER_SIZE];
+    int handle;
+} omx_arg_t;
+
+static void bench_omx_pts(void *data, uint32_t ops) {
+    omx_arg_t *arg = (omx_arg_t *)data;
+
+    for (uint32_t i = 0; i < ops; i++) set_omx_pts(arg->data, &arg->handle);
+}
+
+static void bench_omx(bench_context_t *bctx) {
+    omx_arg_t arg;
+
+    //a ui buffer: the prefix check fails at once.
+    memset(&arg, 0x5a, sizeof(arg.data));
+    arg.handle = 0;
+    run_bench(bctx, "omx_pts/scan:foreign", bench_omx_pts, &arg, 1000);
+
+    //a tagged buffer whose pts was already sent, no ioctl.
+    memset(&arg, 0, sizeof(arg.data));
+    memcpy(arg.data, BENCH_OMX_SECRET, sizeof(BENCH_OMX_SECRET));
+    memcpy(arg.data + sizeof(BENCH_OMX_SECRET) + sizeof(signed long long),
+            BENCH_OMX_RENDERED, sizeof(BENCH_OMX_RENDERED));
+    arg.handle = 0;
+    run_bench(bctx, "omx_pts/scan:rendered", bench_omx_pts, &arg, 1000);
+}
+
+/*
+vsync
+*/
+
+static volatile int32_t load_running;
+
+static void *load_thread(void *) {
+    volatile uint32_t spin = 0;
+    while (android_atomic_acquire_load(&load_running)) spin++;
+    return NULL;
+}
+
+/*
+The software vsync sleeps until the next period boundary; what matters is
+how late it wakes, with and without every cpu kept busy.
+*/
+static void bench_vsync(bench_context_t *bctx) {
+    hwc_context_1_t *ctx = (hwc_context_1_t *)bctx->hwc;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    char name[64];
+
+    if (ncpu < 1) ncpu = 1;
+    for (long load = 0; load <= ncpu; load += ncpu) {
+        snprintf(name, sizeof(name), "vsync/load:%ld", load);
+        if (!selected(bctx, name)) continue;
+
+        android::Vector<pthread_t> threads;
+        android_atomic_release_store(1, &load_running);
+        for (long i = 0; i < load; i++) {
+            pthread_t t;
+            if (pthread_create(&t, NULL, load_thread, NULL) == 0) threads.add(t);
+        }
+
+        android::Vector<nsecs_t> v;
+        nsecs_t timestamp;
+        wait_next_vsync(ctx, &timestamp);
+        for (uint32_t i = 0; i < bctx->vsyncs; i++) {
+            if (wait_next_vsync(ctx, &timestamp)) continue;
+            v.add(systemTime(CLOCK_MONOTONIC) - timestamp);
+        }
+
+        android_atomic_release_store(0, &load_running);
+        for (size_t i = 0; i < threads.size(); i++) pthread_join(threads[i], NULL);
+        add_result(bctx, name, v, 1);
+    }
+}
+
+/*
+output
+*/
+
+static const char* json_bool(bool b) {
+    return b ? "true" : "false";
+}
+
+static void write_json(bench_context_t *bctx, FILE *out) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"context\": {\"xres\": %u, \"yres\": %u, \"samples\": %u, \"date\": %lld, "
+            "\"config\": {\"external_display\": %s, \"fb1_external\": %s, \"cursor_layer\": %s, "
+            "\"hw_vsync\": %s, \"libplayer\": %s, \"afbc_gralloc\": %s}},\n",
+            fake_fb_xres, fake_fb_yres, bctx->samples, (long long)time(NULL),
+            json_bool(hwc_policy::external_display), json_bool(hwc_policy::fb1_external),
+            json_bool(hwc_policy::cursor_layer), json_bool(hwc_policy::hw_vsync),
+            json_bool(hwc_policy::libplayer), json_bool(hwc_policy::afbc_gralloc));
+    fprintf(out, "  \"benchmarks\": [\n");
+    for (size_t i = 0; i < bctx->results.size(); i++) {
+        bench_result_t const& r = bctx->results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"samples\": %u, \"ops_per_sample\": %u, "
+                "\"mean_ns\": %lld, \"min_ns\": %lld, \"p50_ns\": %lld, \"p99_ns\": %lld, "
+                "\"max_ns\": %lld}%s\n",
+                r.name, r.samples, r.ops_per_sample, (long long)r.mean_ns, (long long)r.min_ns,
+                (long long)r.p50_ns, (long long)r.p99_ns, (long long)r.max_ns,
+                i + 1 < bctx->results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+static void proc_invalidate(const struct hwc_procs*) {}
+static void proc_vsync(const struct hwc_procs*, int, int64_t) {}
+static void proc_hotplug(const struct hwc_procs*, int, int) {}
+
+static const hwc_procs_t bench_procs = {
+    invalidate: proc_invalidate,
+    vsync: proc_vsync,
+    hotplug: proc_hotplug,
+};
+
+static void usage() {
+    fprintf(stderr, "usage: hwc_bench [-s samples] [-v vsyncs] [-f filter] [-o file] [-d tmpdir]\n");
+}
+
+int main(int argc, char** argv) {
+    bench_context_t bctx;
+    const char *output = NULL;
+    int opt;
+
+    bctx.samples = BENCH_DEFAULT_SAMPLES;
+    bctx.vsyncs = BENCH_DEFAULT_VSYNCS;
+    bctx.filter = NULL;
+    bctx.tmpdir = "/data/local/tmp";
+
+    while ((opt = getopt(argc, argv, "s:v:f:o:d:")) != -1) {
+        switch (opt) {
+            case 's':
+                bctx.samples = atoi(optarg);
+            break;
+            case 'v':
+                bctx.vsyncs = atoi(optarg);
+            break;
+            case 'f':
+                bctx.filter = optarg;
+            break;
+            case 'o':
+                output = optarg;
+            break;
+            case 'd':
+                bctx.tmpdir = optarg;
+            break;
+            default:
+                usage();
+            return 1;
+        }
+    }
+    if (bctx.samples == 0) {
+        usage();
+        return 1;
+    }
+
+    hw_device_t *device = NULL;
+    int err = HAL_MODULE_INFO_SYM.common.methods->open(&HAL_MODULE_INFO_SYM.common,
+            HWC_HARDWARE_COMPOSER, &device);
+    if (err) {
+        fprintf(stderr, "open hwcomposer fail: %d\n", err);
+        return 1;
+    }
+    bctx.hwc = (hwc_composer_device_1_t *)device;
+    //with procs registered the hotplug thread waits for uevents instead of spinning.
+    bctx.hwc->registerProcs(bctx.hwc, &bench_procs);
+
+    bench_frames(&bctx);
+    bench_parsers(&bctx);
+    bench_omx(&bctx);
+    bench_vsync(&bctx);
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "open %s fail: %s\n", output, strerror(errno));
+        return 1;
+    }
+    write_json(&bctx, out);
+    if (out != stdout) fclose(out);
+
+    device->close(device);
+    return 0;
+}
@@ -16,9 +16,11 @@
 
 //#define LOG_NDEBUG 0
 #define LOG_TAG "HWComposer"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #include <hardware/hardware.h>
 
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <poll.h>
 #include <pthread.h>
@@ -30,6 +32,8 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <sched.h>
+#include <sys/prctl.h>
 #include <sys/resource.h>
 
 #include <EGL/egl.h>
@@ -50,6 +54,7 @@
 #include <EGL/egl.h>
 #include <utils/Vector.h>
 #include <utils/Timers.h>
+#include <utils/Trace.h>
 #include <system/graphics.h>
 #include <sync/sync.h>
 // for private_handle_t
@@ -60,6 +65,13 @@
 #include <Amavutils.h>
 #endif
 #include "tvp/OmxUtil.h"
+#include "LayerTrace.h"
+#include "DisplayBackend.h"
+#include "BufferCache.h"
+#include "Telemetry.h"
+#include "CostModel.h"
+#include "DisplayPolicy.h"
+#include "FenceWaiter.h"
 
 #ifndef LOGD
 #define LOGD ALOGD
@@ -82,27 +94,65 @@
 #define DBG_LOGA(str)             ALOGI_IF(chk_int_prop("sys.hwc.debuglevel")  >=4,"%10s-%5d %s - " str, HWC_BUILD_NAME, __LINE__,__FUNCTION__)
 #define DBG_LOGB(str, ...)        ALOGI_IF(chk_int_prop("sys.hwc.debuglevel")  >=4,"%10s-%5d %s - " str, HWC_BUILD_NAME, __LINE__,__FUNCTION__, __VA_ARGS__);
 
+//systrace sections and counters, compiled out with HWC_DISABLE_TRACE.
+#ifndef HWC_DISABLE_TRACE
+#define HWC_ATRACE_CALL()               ATRACE_CALL()
+#define HWC_ATRACE_NAME(name)           ATRACE_NAME(name)
+#define HWC_ATRACE_INT(name, value)     ATRACE_INT(name, value)
+#define HWC_ATRACE_INT64(name, value)   ATRACE_INT64(name, value)
+#define HWC_ATRACE_ENABLED()            ATRACE_ENABLED()
+#else
+#define HWC_ATRACE_CALL()
+#define HWC_ATRACE_NAME(name)
+#define HWC_ATRACE_INT(name, value)
+#define HWC_ATRACE_INT64(name, value)
+#define HWC_ATRACE_ENABLED()            0
+#endif
+
 #define SYSFS_AMVIDEO_CURIDX      "/sys/module/amvideo/parameters/cur_dev_idx"
 #define SYSFS_DISPLAY_MODE          "/sys/class/display/mode"
+#define SYSFS_DISPLAY2_MODE         "/sys/class/display2/mode"
 #define SYSFS_FB0_FREE_SCALE        "/sys/class/graphics/fb0/free_scale"
 #define SYSFS_FB1_FREE_SCALE        "/sys/class/graphics/fb0/free_scale"
 #define SYSFS_VIDEO_AXIS               "/sys/class/video/axis"
+#define SYSFS_VIDEO_AXIS_PIP        "/sys/class/video/axis_pip"
+#define SYSFS_VIDEO_DISABLE_PIP     "/sys/class/video/disable_videopip"
 #define SYSFS_VIDEOBUFUSED          "/sys/class/amstream/videobufused"
 #define SYSFS_WINDOW_AXIS           "/sys/class/graphics/fb0/window_axis"
+#define SYSFS_FB0_FREE_SCALE_AXIS   "/sys/class/graphics/fb0/free_scale_axis"
+#define SYSFS_OSD_AFBCD             "/sys/class/graphics/fb%d/osd_afbcd"
+//low 24 bits go to VPP_DUMMY_DATA1, the yuv color under all planes.
+#define SYSFS_VIDEO_TEST_SCREEN     "/sys/class/video/test_screen"
+
+//render the primary ui at a fixed size and let the osd scaler fit it to the output.
+#define HWC_PROP_FREE_SCALE         "persist.sys.hwc.free_scale"
+#define HWC_FREE_SCALE_XRES         1920
+#define HWC_FREE_SCALE_YRES         1080
+
+/*
+osd framebuffer buffers of display %d: 2 for double, 3 for triple buffering.
+SurfaceFlinger allocates NUM_FRAMEBUFFER_SURFACE_BUFFERS fb targets from the
+board config whatever this says, the osd is never sized below that.
+*/
+#define HWC_PROP_FB_BUFFERS         "persist.sys.hwc.fb_buffers.%d"
+#ifndef NUM_FRAMEBUFFER_SURFACE_BUFFERS
+#define NUM_FRAMEBUFFER_SURFACE_BUFFERS 2
+#endif
+#define HWC_FB_MIN_BUFFERS          NUM_FRAMEBUFFER_SURFACE_BUFFERS
+#if NUM_FRAMEBUFFER_SURFACE_BUFFERS > 3
+#define HWC_FB_MAX_BUFFERS          NUM_FRAMEBUFFER_SURFACE_BUFFERS
+#else
+#define HWC_FB_MAX_BUFFERS          3
+#endif
 
 #define MAX_SUPPORT_DISPLAYS HWC_NUM_PHYSICAL_DISPLAY_TYPES
 
-#ifdef SINGLE_EXTERNAL_DISPLAY_USE_FB1
-#undef ENABLE_CURSOR_LAYER
+//in fb1 mode the primary is left alone while the external display is connected.
 #define CHK_SKIP_DISPLAY_FB0(dispIdx) \
-        if (pdev->display_ctxs[HWC_DISPLAY_EXTERNAL].connected\
-            && dispIdx == HWC_DISPLAY_PRIMARY) {\
+        if (hwc_policy::fb1_external && dispIdx == HWC_DISPLAY_PRIMARY\
+            && display_connected(pdev, HWC_DISPLAY_EXTERNAL)) {\
             continue;\
         }
-#else
-#define ENABLE_CURSOR_LAYER 1//cursor layer supported in hwc 1.4
-#define CHK_SKIP_DISPLAY_FB0(dispIdx)   //nothing to do
-#endif
 
 #define get_display_info(ctx,disp) \
     display_context_t * display_ctx = &(ctx->display_ctxs[disp]);\
@@ -110,48 +160,354 @@
 
 typedef struct cursor_context_t{
     bool blank;
+    //cb_info.fd turns valid once fbdev_cursor_init_thread() is done.
     struct framebuffer_info_t cb_info;
+    bool init_started;
+    pthread_t init_thread;
     void *cbuffer;
     bool show;
+    //buffer whose content the cursor osd holds, see fbdev_set_cursor().
+    buffer_handle_t uploaded;
+    uint32_t uploaded_generation;
+    //latest requested position, applied once per vsync.
+    volatile int32_t pending_pos;
+    volatile int32_t pos_requests;
+    int32_t pos_applied;
 }cursor_context_t;
 
-typedef struct display_context_t{
+//cursor positions are packed as two signed 16 bit values into one atomic slot.
+#define CURSOR_POS_PACK(x, y)   ((int32_t)(((uint32_t)(x) << 16) | ((uint32_t)(y) & 0xffff)))
+#define CURSOR_POS_X(pos)       ((int16_t)((uint32_t)(pos) >> 16))
+#define CURSOR_POS_Y(pos)       ((int16_t)((uint32_t)(pos) & 0xffff))
+
+//work the vsync thread applies at the next vsync, bits of latch_pending.
+#define HWC_LATCH_CURSOR(disp)  (1 << (disp))
+#define HWC_LATCH_BACKGROUND    (1 << 9)
+
+#define HWC_BACKGROUND_BLACK    0x000000
+
+/*
+Display state shared across HAL threads. The hotplug thread publishes a new
+snapshot on mode changes, everything else reads a consistent copy through
+the seqlock without blocking, see display_state_read().
+*/
+typedef struct display_state_t{
+    uint32_t version;
     bool connected;
+    uint32_t xres;
+    uint32_t yres;
+    //physical size in mm
+    uint32_t width;
+    uint32_t height;
+    float xdpi;
+    float ydpi;
+    int32_t vsync_period;
+    //size of the output mode, xres/yres is the ui size when the osd scales.
+    uint32_t out_xres;
+    uint32_t out_yres;
+}display_state_t;
+
+/*
+Posts one display's frame on its own thread, so a slow fence wait on one
+display overlaps with the post of the other instead of adding to it.
+*/
+typedef struct post_worker_t{
+    bool running;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct hwc_context_1_t* ctx;
+    int disp;
+    //job, valid while pending is set.
+    bool pending;
+    hwc_display_contents_1_t* contents;
+    int result;
+    nsecs_t post_ns;
+}post_worker_t;
+
+//why a frame reached the screen after its vsync, see hwc_deadline_classify().
+enum {
+    HWC_LATE_SF = 0,        //hwc_set came after the deadline
+    HWC_LATE_FENCE,         //rendering finished after it
+    HWC_LATE_POST,          //the post returned after it
+    HWC_LATE_DISPLAY,       //all was in time, the flip wasn't
+    HWC_LATE_CAUSES
+};
+
+#define HWC_DEADLINE_DEPTH  4
+
+typedef struct hwc_deadline_frame_t{
+    nsecs_t deadline;
+    nsecs_t set_time;
+    nsecs_t post_done;
+    //dups, closed once the frame is classified.
+    int acquire_fence;
+    //signals when the next frame is shown.
+    int release_fence;
+    nsecs_t shown;
+    //-1 on time, else HWC_LATE_*.
+    int late;
+}hwc_deadline_frame_t;
+
+/*
+Posted frames waiting for the flip that shows them, and what became of
+those already shown. Owned by the thread posting the display.
+*/
+typedef struct hwc_deadline_t{
+    hwc_deadline_frame_t frames[HWC_DEADLINE_DEPTH];
+    uint32_t head;
+    uint32_t tail;
+    uint32_t on_time;
+    uint32_t late[HWC_LATE_CAUSES];
+    uint32_t dropped;
+}hwc_deadline_t;
+
+//a framebuffer target the display may still be scanning out.
+typedef struct fb_release_t{
+    buffer_handle_t handle;
+    int fence;
+}fb_release_t;
+
+typedef struct display_context_t{
+    //odd while a new state is being published.
+    volatile int32_t state_seq;
+    display_state_t state;
+    //state version fb_info was last synced to, owned by the posting thread.
+    uint32_t fb_info_version;
+    //output mode of this display, owned by the hotplug thread.
+    char mode[32];
+
     struct framebuffer_info_t fb_info;
     struct private_handle_t*  fb_hnd;
-#ifdef ENABLE_CURSOR_LAYER
+    //brought up by the backend once, survives disconnects.
+    bool initialized;
     struct cursor_context_t cursor_ctx;
-#endif
+    struct post_worker_t post_worker;
+    //state version sideband geometry was last checked at.
+    uint32_t sideband_version;
+    //osd afbc decoder, probed once per osd.
+    bool afbc_capable;
+    bool afbc_enabled;
+    uint32_t afbc_rejected;
+    //estimated bytes the osds fetched for the last frame.
+    uint32_t scan_bytes;
+    //layer hwc_prepare picked for direct scanout, -1 if the fb target is posted.
+    int direct_layer;
+    uint32_t direct_frames;
+    //owned by the thread posting this display.
+    uint32_t frames_posted;
+    uint32_t frames_skipped;
+    nsecs_t cursor_ready_time;
+    //set by the hotplug thread while the output is being switched, see hwc_link_down().
+    volatile int32_t link_down;
+    nsecs_t link_down_time;
+    uint32_t link_drops;
+    //osd framebuffer memory, set by fbdev_set_fb_buffers().
+    uint32_t fb_buffers;
+    uint32_t fb_bytes;
+    //owned by the posting thread, see fb_release_track().
+    fb_release_t fb_releases[HWC_FB_MAX_BUFFERS];
+    uint32_t fb_release_next;
+    uint32_t fb_stalls;
+    //the last fb target posted was afbc.
+    bool fb_afbc;
+    //estimated ddr traffic of the last prepared frame, see hwc_prepare_cost().
+    hwc_frame_cost_t cost;
+    //frames over ddr_threshold.
+    uint32_t over_threshold;
+    //vsync the frame being set is meant for and when hwc_set got it, 0 if unknown.
+    nsecs_t frame_deadline;
+    nsecs_t frame_set_time;
+    hwc_deadline_t deadlines;
+    //last flip seen and the period it was seen at, written by the posting thread
+    //and read by hwc_set between posts, see hwc_frame_deadline().
+    nsecs_t flip_edge;
+    nsecs_t flip_period;
+    //acquire fences of the frames posted, see FenceWaiter.h for who owns what.
+    hwc_fence_stats_t fence_stats;
+    //acquire fence of the last frame posted with a video axis, under video_lock.
+    int video_fence;
+    //acquire fences posted that are pending past the timeout, see fb_fence_done().
+    volatile int32_t fences_stuck;
+    uint32_t stuck_drops;
 }display_context_t;
 
+//HAL threads with a scheduling policy, see hwc_thread_sched().
+enum {
+    HWC_THREAD_VSYNC = 0,
+    HWC_THREAD_HOTPLUG,
+    HWC_THREAD_FENCE,
+    HWC_THREAD_POST,
+    HWC_THREAD_MAX = HWC_THREAD_POST + MAX_SUPPORT_DISPLAYS
+};
+
+//leave the nice value the thread inherited.
+#define HWC_SCHED_NICE_KEEP     INT_MAX
+
+typedef struct hwc_thread_sched_t{
+    const char* name;
+    pid_t tid;
+    //requested, from persist.sys.hwc.sched.<name>.
+    int fifo;
+    uint32_t cpus;
+    int slack_ns;
+    //what the kernel granted.
+    int policy;
+    int nice;
+    bool affinity_set;
+}hwc_thread_sched_t;
+
+//video layers of the vpp, overlays are assigned to them in hwc_prepare.
+enum {
+    VIDEO_PLANE_MAIN = 0,
+    VIDEO_PLANE_PIP,
+    VIDEO_PLANE_MAX
+};
+
+typedef struct video_plane_t{
+    //identity of the overlay assigned in the last prepare: buffer or sideband handle.
+    const void* owner;
+    //axis last requested by hwc_set.
+    hwc_rect_t frame;
+    uint32_t transform;
+    uint32_t state_version;
+    //the rest under video_lock. Display whose frames the axis goes with.
+    int disp;
+    //axis waiting for the next frame of disp to be posted.
+    bool pending;
+    hwc_rect_t pending_frame;
+    uint32_t pending_transform;
+    //axis of the frame posted, waiting for its acquire fence, see hwc_video_post().
+    bool posted;
+    hwc_rect_t posted_frame;
+    uint32_t posted_transform;
+    //axis on the hardware.
+    bool active;
+    hwc_rect_t applied_frame;
+    uint32_t applied_transform;
+    uint32_t requests;
+    uint32_t superseded;
+    uint32_t applied;
+}video_plane_t;
+
+#define VIDEO_SYSFS_POLL_INTERVAL   ms2ns(200)
+
+typedef struct video_sysfs_state_t{
+    nsecs_t poll_time;
+    char last_val[32];
+    char last_axis[32];
+    char last_mode[32];
+    char last_free_scale[32];
+    char last_window_axis[50];
+    //the axis node changed because we wrote it, don't report it.
+    volatile int32_t axis_resync;
+}video_sysfs_state_t;
+
+//recent frame decisions, written by hwc_set and rendered by hwc_dump.
+#define HWC_FRAME_LOG_SIZE          32  //must be power of 2
+#define HWC_FRAME_LOG_MAX_LAYERS    16
+
+typedef struct hwc_frame_record_t{
+    //odd while the slot is being written.
+    volatile int32_t seq;
+    uint32_t frame;
+    int32_t disp;
+    int32_t num_layers;
+    char types[HWC_FRAME_LOG_MAX_LAYERS + 1];
+    bool axis_applied;
+    hwc_rect_t axis;
+    int32_t post_err;
+    int32_t release_fence;
+    int32_t retire_fence;
+    nsecs_t set_time;
+    nsecs_t prepare_ns;
+    nsecs_t post_ns;
+    uint32_t scan_bytes;
+    uint64_t ddr_bytes;
+}hwc_frame_record_t;
+
+typedef struct hwc_frame_log_t{
+    volatile int32_t head;
+    hwc_frame_record_t records[HWC_FRAME_LOG_SIZE];
+}hwc_frame_log_t;
+
 struct hwc_context_1_t {
     hwc_composer_device_1_t base;
 
     /* our private state goes below here */
-    hwc_layer_1_t const* saved_layer;
-    unsigned saved_transform;
-    int saved_left;
-    int saved_top;
-    int saved_right;
-    int saved_bottom;
+    bool free_scale;
+    //vpp background as 0xRRGGBB: picked by prepare, queued by set, applied at vsync.
+    int32_t bg_color;
+    volatile int32_t bg_pending;
+    int32_t bg_applied;
+    pthread_mutex_t video_lock;
+    //displays with a video axis or release waiting for their next post, a bit per display.
+    volatile int32_t video_post_pending;
+    video_plane_t video_planes[VIDEO_PLANE_MAX];
+    int num_video_planes;
+    bool dualdisplay4;
+    video_sysfs_state_t video_sysfs;
 
     //vsync.
-    int32_t vsync_period;
-    int vsync_enable;
+    volatile int32_t vsync_enable;
+    volatile int32_t latch_pending;
     pthread_t vsync_thread;
+    //last vsync delivered, odd seq while it is being written.
+    volatile int32_t vsync_edge_seq;
+    nsecs_t vsync_edge;
+    //software vsync phase, owned by the vsync thread.
+    nsecs_t vsync_time;
+    nsecs_t vsync_anchor_period;
+    //set when the primary mode changed, the next vsync starts a new phase.
+    volatile int32_t vsync_reanchor;
+
+    //startup, see hwc_dump().
+    nsecs_t open_time;
+    nsecs_t open_ns;
+    nsecs_t first_vsync_time;
 
     bool blank_status;
 
     //video buf is used flag
     char video_buf_used[32];
-    //hdmi output mode
-    char mode[32];
 
     const hwc_procs_t *procs;
     pthread_t hotplug_thread;
 
     private_module_t *gralloc_module;
     display_context_t display_ctxs[MAX_SUPPORT_DISPLAYS];
+    //per-buffer facts, one cache per display, see BufferCache.h
+    hwc_buffer_cache_t buffer_caches[HWC_NUM_DISPLAY_TYPES];
+
+    //display i/o, see DisplayBackend.h
+    hwc_backend_t backend;
+    //layer stack recorder, see LayerTrace.h
+    hwc_trace_t trace;
+    //counters for monitoring agents, see Telemetry.h
+    hwc_telemetry_t telemetry;
+    //owned by the vsync thread.
+    hwc_telemetry_vsync_t vsync_stats;
+    nsecs_t vsync_woke;
+    //each entry written once by its own thread.
+    hwc_thread_sched_t thread_sched[HWC_THREAD_MAX];
+
+    nsecs_t prepare_time;
+    nsecs_t prepare_ns;
+    //HWC_PROP_DDR_THRESHOLD in bytes per second, 0 for none.
+    uint64_t ddr_threshold;
+    //HWC_PROP_FENCE_TIMEOUT, -1 for never stuck.
+    int fence_timeout_ms;
+    hwc_fence_waiter_t fence_waiter;
+    pthread_t fence_thread;
+    bool fence_thread_running;
+    uint32_t frame_count;
+    hwc_frame_log_t frame_log;
+
+    //running totals, exported as systrace counters.
+    int32_t overlay_axis_count;
+    volatile int32_t fence_wait_count;
+    volatile int32_t cursor_upload_count;
+    int32_t vsync_toggle;
 };
 
 typedef struct hwc_uevent_data {
@@ -164,6 +520,76 @@ typedef struct hwc_uevent_data {
 static pthread_cond_t hwc_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t hwc_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+Seqlock over display_context_t.state. Writers are serialized by hwc_mutex
+and only run on connect or mode change, readers never take a lock.
+*/
+static void display_state_publish(display_context_t* display_ctx, display_state_t* state) {
+    int32_t seq = display_ctx->state_seq;
+
+    state->version = display_ctx->state.version + 1;
+    android_atomic_release_store(seq + 1, &display_ctx->state_seq);
+    android_memory_barrier();
+    memcpy(&display_ctx->state, state, sizeof(display_state_t));
+    android_atomic_release_store(seq + 2, &display_ctx->state_seq);
+}
+
+static void display_state_read(display_context_t* display_ctx, display_state_t* state) {
+    int32_t seq;
+
+    do {
+        seq = android_atomic_acquire_load(&display_ctx->state_seq);
+        if (seq & 1) continue;
+        memcpy(state, &display_ctx->state, sizeof(display_state_t));
+        android_memory_barrier();
+    } while ((seq & 1) || seq != android_atomic_acquire_load(&display_ctx->state_seq));
+}
+
+static bool display_connected(hwc_context_1_t* ctx, int disp) {
+    display_state_t state;
+
+    display_state_read(&ctx->display_ctxs[disp], &state);
+    return state.connected;
+}
+
+static int32_t display_vsync_period(hwc_context_1_t* ctx, int disp) {
+    display_state_t state;
+
+    display_state_read(&ctx->display_ctxs[disp], &state);
+    return state.vsync_period;
+}
+
+/*
+Link state of an hdmi output. Switching the output mode takes the link
+down (hdmi_audio or hdmi_power state 0) and brings it back with the new
+mode (state 1). Posts in between are dropped. A down event that is never
+followed by an up, e.g. an unplug that moves the box to cvbs, only holds
+posts back for HWC_LINK_DOWN_TIMEOUT.
+*/
+#define HWC_LINK_DOWN_TIMEOUT   s2ns(3)
+
+static bool hwc_link_is_down(display_context_t* display_ctx) {
+    if (!android_atomic_acquire_load(&display_ctx->link_down)) return false;
+    return systemTime(CLOCK_MONOTONIC) - display_ctx->link_down_time < HWC_LINK_DOWN_TIMEOUT;
+}
+
+//apply a newer published mode to fb_info before the framebuffer helpers use it.
+static void display_sync_fb_info(display_context_t* display_ctx) {
+    display_state_t state;
+    framebuffer_info_t* fbinfo = &(display_ctx->fb_info);
+
+    display_state_read(display_ctx, &state);
+    if (state.version == display_ctx->fb_info_version) return;
+
+    fbinfo->info.xres = state.xres;
+    fbinfo->info.yres = state.yres;
+    fbinfo->info.width = state.width;
+    fbinfo->info.height = state.height;
+    fbinfo->xdpi = state.xdpi;
+    fbinfo->ydpi = state.ydpi;
+    display_ctx->fb_info_version = state.version;
+}
+
 extern "C" int clock_nanosleep(clockid_t clock_id, int flags,
                            const struct timespec *request, struct timespec *remain);
 int init_display(hwc_context_1_t* context,int displayType);
@@ -192,6 +618,76 @@ static int chk_int_prop(const char* prop) {
     return 0;
 }
 
+/*
+Scheduling of the calling HAL thread, from persist.sys.hwc.sched.<name>:
+
+    fifo=<prio>     SCHED_FIFO priority, falls back to nice if refused
+    nice=<n>        nice value while on SCHED_OTHER
+    cpus=<mask>     hex affinity mask
+    slack=<ns>      timer slack, SCHED_FIFO threads have none anyway
+
+e.g. "fifo=2 cpus=0x3". Unset options keep the built-in nice and
+whatever affinity and slack the thread inherited.
+*/
+static void hwc_thread_sched(hwc_context_1_t* ctx, int id, const char* name, int nice) {
+    hwc_thread_sched_t* sched = &ctx->thread_sched[id];
+    char prop[PROPERTY_KEY_MAX];
+    char val[PROPERTY_VALUE_MAX];
+    char* save = NULL;
+
+    sched->name = name;
+    sched->tid = gettid();
+    sched->fifo = 0;
+    sched->cpus = 0;
+    sched->slack_ns = -1;
+
+    snprintf(prop, sizeof(prop), "persist.sys.hwc.sched.%s", name);
+    memset(val, 0, sizeof(val));
+    property_get(prop, val, "");
+    for (char* opt = strtok_r(val, " ,", &save); opt; opt = strtok_r(NULL, " ,", &save)) {
+        if (sscanf(opt, "fifo=%d", &sched->fifo) == 1) continue;
+        if (sscanf(opt, "nice=%d", &nice) == 1) continue;
+        if (sscanf(opt, "cpus=%x", &sched->cpus) == 1) continue;
+        if (sscanf(opt, "slack=%d", &sched->slack_ns) == 1) continue;
+        HWC_LOGWB("%s: unknown option %s", prop, opt);
+    }
+
+    if (sched->fifo > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = sched->fifo;
+        if (sched_setscheduler(0, SCHED_FIFO, &param)) {
+            HWC_LOGWB("%s thread: SCHED_FIFO %d refused: %s", name, sched->fifo, strerror(errno));
+        }
+    }
+    sched->policy = sched_getscheduler(0);
+    if (sched->policy != SCHED_FIFO && nice != HWC_SCHED_NICE_KEEP) {
+        setpriority(PRIO_PROCESS, 0, nice);
+    }
+    sched->nice = getpriority(PRIO_PROCESS, 0);
+
+    sched->affinity_set = false;
+    if (sched->cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < 32; cpu++) {
+            if (sched->cpus & (1u << cpu)) CPU_SET(cpu, &set);
+        }
+        sched->affinity_set = sched_setaffinity(0, sizeof(set), &set) == 0;
+        if (!sched->affinity_set) {
+            HWC_LOGWB("%s thread: affinity 0x%x refused: %s", name, sched->cpus, strerror(errno));
+        }
+    }
+
+    //0 would mean back to the default slack, 1ns is as low as it goes.
+    if (sched->slack_ns >= 0) {
+        prctl(PR_SET_TIMERSLACK, sched->slack_ns > 0 ? sched->slack_ns : 1, 0, 0, 0);
+    }
+
+    HWC_LOGDB("%s thread %d: %s, nice %d, cpus 0x%x, slack %d", name, sched->tid,
+        sched->policy == SCHED_FIFO ? "fifo" : "other", sched->nice, sched->cpus, sched->slack_ns);
+}
+
 static int chk_and_dup(int fence) {
     if (fence < 0) {
         HWC_LOGWB("not a vliad fence %d",fence);
@@ -225,10 +721,10 @@ static bool chk_sysfs_status(const char* sysfstr, char* lastr, int size) {
 }
 #endif
 
-static int32_t chk_output_mode(char* curmode) {
-    int modefd = open(SYSFS_DISPLAY_MODE, O_RDONLY);
+static int32_t chk_output_mode(const char* path, char* curmode) {
+    int modefd = open(path, O_RDONLY);
     if (modefd < 0) {
-        HWC_LOGEB("open (%s) fail", SYSFS_DISPLAY_MODE);
+        HWC_LOGEB("open (%s) fail", path);
         return -1;
     }
 
@@ -261,40 +757,479 @@ static int32_t chk_output_mode(char* curmode) {
     return period;
 }
 
-static bool chk_vinfo(hwc_context_1_t* ctx, int disp) {
-    get_display_info(ctx, disp);
-    if (fbinfo != NULL && fbinfo->fd >= 0) {
-        struct fb_var_screeninfo vinfo;
-        if (ioctl(fbinfo->fd, FBIOGET_VSCREENINFO, &vinfo) == -1)
-        {
-            ALOGE("FBIOGET_VSCREENINFO error!!!");
+static const char* display_mode_path(int disp) {
+    return disp == HWC_DISPLAY_EXTERNAL ? SYSFS_DISPLAY2_MODE : SYSFS_DISPLAY_MODE;
+}
+
+static int sysfs_write_str(const char* path, const char* val) {
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        HWC_LOGEB("open (%s) fail", path);
+        return -errno;
+    }
+
+    int len = strlen(val);
+    int ret = (write(fd, val, len) == len) ? 0 : -errno;
+    close(fd);
+    return ret;
+}
+
+static bool buffer_is_afbc(private_handle_t const* hnd) {
+#if MALI_AFBC_GRALLOC
+    return (hnd->internal_format & GRALLOC_ARM_INTFMT_AFBC) != 0;
+#else
+    return false;
+#endif
+}
+
+static uint32_t format_bytes_per_pixel(int format) {
+    switch (format) {
+        case HAL_PIXEL_FORMAT_RGB_565:
+            return 2;
+        case HAL_PIXEL_FORMAT_RGB_888:
+            return 3;
+        default:
+            return 4;
+    }
+}
+
+//estimated bytes the osd fetches to scan hnd out once, see CostModel.h
+static uint32_t buffer_scan_bytes(private_handle_t const* hnd) {
+    return hwc_cost_buffer_bytes(hnd->width, hnd->height,
+            hnd->stride * hnd->height * format_bytes_per_pixel(hnd->format), buffer_is_afbc(hnd));
+}
+
+static bool format_is_opaque(int format) {
+    return format == HAL_PIXEL_FORMAT_RGBX_8888
+        || format == HAL_PIXEL_FORMAT_RGB_888
+        || format == HAL_PIXEL_FORMAT_RGB_565;
+}
+
+static void buffer_info_fill(hwc_buffer_info_t* info, void*) {
+    private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(info->handle);
+
+    if (buffer_is_afbc(hnd)) info->flags |= HWC_BUFFER_AFBC;
+    if (format_is_opaque(hnd->format)) info->flags |= HWC_BUFFER_OPAQUE;
+    info->scan_bytes = buffer_scan_bytes(hnd);
+}
+
+//cached facts about handle as seen by disp, NULL if it is no gralloc buffer.
+static hwc_buffer_info_t* buffer_info(hwc_context_1_t* ctx, int disp, buffer_handle_t handle) {
+    return hwc_buffer_cache_get(&ctx->buffer_caches[disp], handle, buffer_info_fill, NULL);
+}
+
+//turn the afbc decoder of the osd on or off, it has to match the next buffer posted.
+static void osd_set_afbc(display_context_t* display_ctx, bool enable) {
+    char path[64];
+
+    snprintf(path, sizeof(path), SYSFS_OSD_AFBCD, display_ctx->fb_info.fbIdx);
+    if (sysfs_write_str(path, enable ? "1" : "0") == 0) {
+        display_ctx->afbc_enabled = enable;
+    }
+}
+
+static bool mode_to_size(const char* mode, uint32_t* w, uint32_t* h) {
+    if (strstr(mode, "smpte")) {
+        *w = 4096; *h = 2160;
+    } else if (strstr(mode, "2160") || strstr(mode, "4k2k")) {
+        *w = 3840; *h = 2160;
+    } else if (strstr(mode, "1080")) {
+        *w = 1920; *h = 1080;
+    } else if (strstr(mode, "720")) {
+        *w = 1280; *h = 720;
+    } else if (strstr(mode, "576")) {
+        *w = 720; *h = 576;
+    } else if (strstr(mode, "480")) {
+        *w = 720; *h = 480;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+Resize the primary osd to the fixed ui size, once before the framebuffer
+is registered with gralloc, which carves the framebuffer targets out of
+it. From then on SurfaceFlinger sees the same ui size in every output mode
+and only the osd scaler changes.
+*/
+static int free_scale_init(display_context_t* display_ctx) {
+    framebuffer_info_t* fbinfo = &display_ctx->fb_info;
+    struct fb_var_screeninfo vinfo;
+
+    if (fbinfo->fd < 0) return -ENODEV;
+    if (ioctl(fbinfo->fd, FBIOGET_VSCREENINFO, &vinfo) == -1) return -errno;
+
+    if (vinfo.xres != HWC_FREE_SCALE_XRES || vinfo.yres != HWC_FREE_SCALE_YRES) {
+        uint32_t num_buffers = vinfo.yres ? vinfo.yres_virtual / vinfo.yres : 2;
+        vinfo.xres = vinfo.xres_virtual = HWC_FREE_SCALE_XRES;
+        vinfo.yres = HWC_FREE_SCALE_YRES;
+        vinfo.yres_virtual = HWC_FREE_SCALE_YRES * num_buffers;
+        vinfo.xoffset = vinfo.yoffset = 0;
+        if (ioctl(fbinfo->fd, FBIOPUT_VSCREENINFO, &vinfo) == -1) {
+            HWC_LOGEB("resize osd to %dx%d fail: %s",
+                HWC_FREE_SCALE_XRES, HWC_FREE_SCALE_YRES, strerror(errno));
             return -errno;
         }
+    }
 
-        if (vinfo.xres != fbinfo->info.xres
-            || vinfo.yres != fbinfo->info.yres
-            || vinfo.width != fbinfo->info.width
-            || vinfo.height != fbinfo->info.height) {
-            if (int(vinfo.width) <= 16 || int(vinfo.height) <= 9) {
-                // the driver doesn't return that information
-                // default to 160 dpi
-                vinfo.width  = ((vinfo.xres * 25.4f)/160.0f + 0.5f);
-                vinfo.height = ((vinfo.yres * 25.4f)/160.0f + 0.5f);
-            }
-            fbinfo->xdpi = (vinfo.xres * 25.4f) / vinfo.width;
-            fbinfo->ydpi = (vinfo.yres * 25.4f) / vinfo.height;
+    if (ioctl(fbinfo->fd, FBIOGET_VSCREENINFO, &fbinfo->info) == -1
+        || ioctl(fbinfo->fd, FBIOGET_FSCREENINFO, &fbinfo->finfo) == -1) {
+        return -errno;
+    }
+    fbinfo->fbSize = fbinfo->finfo.line_length * fbinfo->info.yres_virtual;
+    HWC_LOGDB("ui free scale at %dx%d", fbinfo->info.xres, fbinfo->info.yres);
+    return 0;
+}
 
-            fbinfo->info.xres = vinfo.xres;
-            fbinfo->info.yres = vinfo.yres;
-            fbinfo->info.width = vinfo.width;
-            fbinfo->info.height = vinfo.height;
+//called with hwc_mutex held, points the osd scaler at the current output mode.
+static void chk_free_scale(hwc_context_1_t* ctx, int disp) {
+    display_context_t* display_ctx = &ctx->display_ctxs[disp];
+    display_state_t state = display_ctx->state;
+    uint32_t out_w = state.xres, out_h = state.yres;
+    char axis[64];
 
-            return true;
+    if (ctx->free_scale && disp == HWC_DISPLAY_PRIMARY) {
+        mode_to_size(display_ctx->mode, &out_w, &out_h);
+    }
+    if (out_w == state.out_xres && out_h == state.out_yres) return;
+
+    if (ctx->free_scale && disp == HWC_DISPLAY_PRIMARY) {
+        if (out_w == state.xres && out_h == state.yres) {
+            sysfs_write_str(SYSFS_FB0_FREE_SCALE, "0");
+        } else {
+            snprintf(axis, sizeof(axis), "0 0 %d %d", state.xres - 1, state.yres - 1);
+            sysfs_write_str(SYSFS_FB0_FREE_SCALE_AXIS, axis);
+            snprintf(axis, sizeof(axis), "0 0 %d %d", out_w - 1, out_h - 1);
+            sysfs_write_str(SYSFS_WINDOW_AXIS, axis);
+            sysfs_write_str(SYSFS_FB0_FREE_SCALE, "0x10001");
         }
+        HWC_LOGDB("ui %dx%d scaled to output %dx%d", state.xres, state.yres, out_w, out_h);
+    }
+
+    state.out_xres = out_w;
+    state.out_yres = out_h;
+    display_state_publish(display_ctx, &state);
+}
+
+/*
+fbdev backend: the osd devices through libfbcnf. Primary is osd0 and
+external osd2, each with its cursor on the next osd if
+hwc_policy::cursor_layer.
+*/
+
+/*
+The cursor osd is set up in a local copy and published by its fd last;
+until then fbdev_caps() leaves the cursor to GLES.
+*/
+static void *fbdev_cursor_init_thread(void *data) {
+    display_context_t* display_ctx = (display_context_t*)data;
+    cursor_context_t* cursor_ctx = &(display_ctx->cursor_ctx);
+    framebuffer_info_t cbinfo;
+
+    memset(&cbinfo, 0, sizeof(cbinfo));
+    cbinfo.fd = -1;
+
+    //init information from cursor framebuffer.
+    cbinfo.fbIdx = display_ctx->fb_info.displayType*2+1;
+    if (1 != cbinfo.fbIdx && 3 != cbinfo.fbIdx) {
+        HWC_LOGEB("invalid fb index: %d, need to check!",cbinfo.fbIdx);
+        return NULL;
+    }
+    int err = init_cursor_buffer_locked(&cbinfo);
+    if (err != 0 || cbinfo.fd < 0) {
+        HWC_LOGEA("init_cursor_buffer_locked failed, need to check!");
+        return NULL;
+    }
+    HWC_LOGDB("init_cursor_buffer get cbinfo->fbIdx (%d) cbinfo->info.xres (%d) cbinfo->info.yres (%d)",
+                        cbinfo.fbIdx,
+                        cbinfo.info.xres,
+                        cbinfo.info.yres);
+
+    int fd = cbinfo.fd;
+    cbinfo.fd = -1;
+    cursor_ctx->cb_info = cbinfo;
+    android_atomic_release_store(fd, &cursor_ctx->cb_info.fd);
+    display_ctx->cursor_ready_time = systemTime(CLOCK_MONOTONIC);
+    HWC_LOGDA("init_cursor_buffer success!");
+    return NULL;
+}
+
+/*
+Size the osd memory to the configured buffer count before the framebuffer
+is registered, gralloc carves the framebuffer targets out of it.
+*/
+static void fbdev_set_fb_buffers(display_context_t* display_ctx, int disp) {
+    framebuffer_info_t* fbinfo = &display_ctx->fb_info;
+    char prop[PROPERTY_KEY_MAX];
+    char val[PROPERTY_VALUE_MAX];
+
+    if (fbinfo->fd < 0 || !fbinfo->info.yres) return;
+    uint32_t num_buffers = fbinfo->info.yres_virtual / fbinfo->info.yres;
+
+    snprintf(prop, sizeof(prop), HWC_PROP_FB_BUFFERS, disp);
+    uint32_t wanted = num_buffers;
+    if (property_get(prop, val, NULL) > 0) wanted = atoi(val);
+    if (wanted < HWC_FB_MIN_BUFFERS) {
+        //gralloc would run out of framebuffer memory on SurfaceFlinger's last dequeue.
+        HWC_LOGEB("%s: %u osd buffers, but SurfaceFlinger allocates %d fb targets, using %d",
+            prop, wanted, NUM_FRAMEBUFFER_SURFACE_BUFFERS, HWC_FB_MIN_BUFFERS);
+        wanted = HWC_FB_MIN_BUFFERS;
+    }
+    if (wanted > HWC_FB_MAX_BUFFERS) {
+        HWC_LOGWB("%s: %u buffers not supported", prop, wanted);
+    } else if (wanted != num_buffers) {
+        struct fb_var_screeninfo vinfo = fbinfo->info;
+        vinfo.yres_virtual = vinfo.yres * wanted;
+        vinfo.yoffset = 0;
+        if (ioctl(fbinfo->fd, FBIOPUT_VSCREENINFO, &vinfo) == -1
+            || ioctl(fbinfo->fd, FBIOGET_VSCREENINFO, &fbinfo->info) == -1
+            || ioctl(fbinfo->fd, FBIOGET_FSCREENINFO, &fbinfo->finfo) == -1) {
+            HWC_LOGEB("disp %d: %u osd buffers fail: %s", disp, wanted, strerror(errno));
+        }
+        num_buffers = fbinfo->info.yres_virtual / fbinfo->info.yres;
+        fbinfo->fbSize = fbinfo->finfo.line_length * fbinfo->info.yres_virtual;
+    }
+
+    display_ctx->fb_buffers = num_buffers;
+    display_ctx->fb_bytes = fbinfo->fbSize;
+    HWC_LOGIB("disp %d: %u osd buffers, %u KB", disp, num_buffers, fbinfo->fbSize / 1024);
+}
+
+static int fbdev_init_display(hwc_backend_t* be, int disp) {
+    hwc_context_1_t* context = (hwc_context_1_t*)be->priv;
+    if (disp >= MAX_SUPPORT_DISPLAYS) return -EINVAL;
+    get_display_info(context, disp);
+
+    //init information from osd.
+    fbinfo->displayType = disp;
+    fbinfo->fbIdx = getOsdIdx(fbinfo->displayType);
+    int err = init_frame_buffer_locked(fbinfo);
+    //the osd scaler is fbdev only.
+    if (disp == HWC_DISPLAY_PRIMARY && chk_bool_prop(HWC_PROP_FREE_SCALE)) {
+        context->free_scale = free_scale_init(display_ctx) == 0;
+    }
+    fbdev_set_fb_buffers(display_ctx, disp);
+    int bufferSize = fbinfo->finfo.line_length * fbinfo->info.yres;
+    HWC_LOGDB("init_frame_buffer get fbinfo->fbIdx (%d) fbinfo->info.xres (%d) fbinfo->info.yres (%d)",fbinfo->fbIdx, fbinfo->info.xres,fbinfo->info.yres);
+    int usage = 0;
+    if (disp > 0) usage |= GRALLOC_USAGE_EXTERNAL_DISP;
+
+    //Register the framebuffer to gralloc module
+    display_ctx->fb_hnd = new private_handle_t(private_handle_t::PRIV_FLAGS_FRAMEBUFFER, usage, fbinfo->fbSize, 0,
+                                                                0, fbinfo->fd, bufferSize, 0);
+    context->gralloc_module->base.registerBuffer(&(context->gralloc_module->base),display_ctx->fb_hnd);
+    HWC_LOGDB("init_frame_buffer get frame size %d usage %d",bufferSize,usage);
+
+    char afbcd[64];
+    snprintf(afbcd, sizeof(afbcd), SYSFS_OSD_AFBCD, fbinfo->fbIdx);
+    display_ctx->afbc_capable = access(afbcd, W_OK) == 0;
+
+    //nothing needs the cursor osd before the first frame, bring it up on the side.
+    if (hwc_policy::cursor_layer) {
+        cursor_context_t* cursor_ctx = &(display_ctx->cursor_ctx);
+        cursor_ctx->show = false;
+        cursor_ctx->cb_info.fd = -1;
+        cursor_ctx->init_started = pthread_create(&cursor_ctx->init_thread, NULL,
+                fbdev_cursor_init_thread, &context->display_ctxs[disp]) == 0;
+        if (!cursor_ctx->init_started) fbdev_cursor_init_thread(&context->display_ctxs[disp]);
+    }
+
+    return 0;
+}
+
+static int fbdev_get_mode(hwc_backend_t* be, int disp, hwc_backend_mode_t* mode) {
+    hwc_context_1_t* ctx = (hwc_context_1_t*)be->priv;
+    if (disp >= MAX_SUPPORT_DISPLAYS) return -EINVAL;
+    get_display_info(ctx, disp);
+
+    struct fb_var_screeninfo vinfo;
+    if (fbinfo->fd < 0) return -ENODEV;
+    if (ioctl(fbinfo->fd, FBIOGET_VSCREENINFO, &vinfo) == -1) return -errno;
+
+    mode->xres = vinfo.xres;
+    mode->yres = vinfo.yres;
+    mode->width = vinfo.width;
+    mode->height = vinfo.height;
+    //the osd doesn't know the refresh rate, the display mode node does.
+    mode->vsync_period = 0;
+    return 0;
+}
+
+static uint32_t fbdev_caps(hwc_backend_t* be, int disp) {
+    hwc_context_1_t* ctx = (hwc_context_1_t*)be->priv;
+    uint32_t caps = 0;
+
+    if (hwc_policy::cursor_layer && disp < MAX_SUPPORT_DISPLAYS
+        && android_atomic_acquire_load(&ctx->display_ctxs[disp].cursor_ctx.cb_info.fd) >= 0) {
+        caps |= HWC_BACKEND_CAP_CURSOR;
+    }
+    return caps;
+}
+
+/*
+libfbcnf can only pan the osd within its own framebuffer memory, which
+app buffers never come from, and has no way to import another buffer.
+*/
+static int fbdev_test(hwc_backend_t*, int, hwc_layer_1_t const*) {
+    return -ENOSYS;
+}
+
+static int fbdev_post(hwc_backend_t* be, int disp, buffer_handle_t hnd,
+        int acquire_fence, int* release_fence) {
+    hwc_context_1_t* ctx = (hwc_context_1_t*)be->priv;
+    get_display_info(ctx, disp);
+
+    display_sync_fb_info(display_ctx);
+    *release_fence = fb_post_with_fence_locked(fbinfo, hnd, acquire_fence);
+    //-1 means no fence, less than -1 is some error
+    if (*release_fence >= 0) return 0;
+    int err = *release_fence < -1 ? *release_fence : 0;
+    *release_fence = -1;
+    return err;
+}
+
+static int fbdev_set_cursor(hwc_backend_t* be, int disp, buffer_handle_t handle) {
+    if (!hwc_policy::cursor_layer) return -ENOSYS;
+
+    hwc_context_1_t* ctx = (hwc_context_1_t*)be->priv;
+    cursor_context_t * cursor_ctx = &(ctx->display_ctxs[disp].cursor_ctx);
+    framebuffer_info_t* cbinfo = &(cursor_ctx->cb_info);
+    bool cursor_show = handle != NULL;
+
+    /*
+    A new cursor image always comes in another buffer than the one on
+    screen, so the copy is only redone when the buffer changes.
+    */
+    hwc_buffer_info_t const* info = handle ? buffer_info(ctx, disp, handle) : NULL;
+    if (info && (info->handle != cursor_ctx->uploaded
+            || info->generation != cursor_ctx->uploaded_generation)) {
+        private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(handle);
+        HWC_LOGDB("This is a Sprite, hnd->stride is %d, hnd->height is %d", hnd->stride, hnd->height);
+        HWC_LOGDB("disp: %d cursor need to redrew", disp);
+        HWC_ATRACE_INT("HWC_cursor_upload", android_atomic_inc(&ctx->cursor_upload_count) + 1);
+        cursor_ctx->uploaded = info->handle;
+        cursor_ctx->uploaded_generation = info->generation;
+        if (cbinfo->info.xres != (unsigned int)hnd->stride || cbinfo->info.yres != (unsigned int)hnd->height) {
+            update_cursor_buffer_locked(cbinfo, hnd->stride, hnd->height);
+        }
+        cursor_ctx->cbuffer = mmap(NULL, hnd->size, PROT_READ|PROT_WRITE, MAP_SHARED, cbinfo->fd, 0);
+        if (cursor_ctx->cbuffer != MAP_FAILED) {
+            memcpy(cursor_ctx->cbuffer, hnd->base, hnd->size);
+            munmap(cursor_ctx->cbuffer, hnd->size);
+            HWC_LOGDA("setCursor ok");
+        } else {
+            HWC_LOGEA("buffer mmap fail");
+        }
+    }
+
+    if (cbinfo->fd > 0 && (cursor_show != cursor_ctx->show) ) {
+        cursor_ctx->show = cursor_show;
+        HWC_LOGVB("UPDATE FB1 status to %d ",cursor_show);
+        ioctl(cbinfo->fd, FBIOBLANK, !cursor_ctx->show);
+    }
+    return 0;
+}
+
+static int fbdev_set_cursor_pos(hwc_backend_t* be, int disp, int x, int y) {
+    if (!hwc_policy::cursor_layer) return -ENOSYS;
+
+    hwc_context_1_t* ctx = (hwc_context_1_t*)be->priv;
+    framebuffer_info_t* cbinfo = &(ctx->display_ctxs[disp].cursor_ctx.cb_info);
+    struct fb_cursor cinfo;
+
+    if (cbinfo->fd < 0) return -ENODEV;
+
+    memset(&cinfo, 0, sizeof(cinfo));
+    cinfo.hot.x = x;
+    cinfo.hot.y = y;
+    return ioctl(cbinfo->fd, FBIO_CURSOR, &cinfo) == -1 ? -errno : 0;
+}
+
+static int fbdev_wait_vblank(hwc_backend_t*, int, nsecs_t*) {
+    return -ENOSYS;
+}
+
+static void fbdev_close(hwc_backend_t* be) {
+    hwc_context_1_t* ctx = (hwc_context_1_t*)be->priv;
+    for (int i = 0; i < MAX_SUPPORT_DISPLAYS; i++) {
+        cursor_context_t* cursor_ctx = &ctx->display_ctxs[i].cursor_ctx;
+        if (cursor_ctx->init_started) pthread_join(cursor_ctx->init_thread, NULL);
+        cursor_ctx->init_started = false;
+    }
+}
+
+static const hwc_backend_ops_t fbdev_backend_ops = {
+    name: "fbdev",
+    close: fbdev_close,
+    init_display: fbdev_init_display,
+    get_mode: fbdev_get_mode,
+    caps: fbdev_caps,
+    test: fbdev_test,
+    post: fbdev_post,
+    set_cursor: fbdev_set_cursor,
+    set_cursor_pos: fbdev_set_cursor_pos,
+    wait_vblank: fbdev_wait_vblank,
+};
+
+//called with hwc_mutex held, publishes a new display state if the mode changed.
+static bool chk_vinfo(hwc_context_1_t* ctx, int disp) {
+    display_context_t* display_ctx = &ctx->display_ctxs[disp];
+    hwc_backend_t* be = &ctx->backend;
+    hwc_backend_mode_t mode;
+
+    if (be->ops->get_mode(be, disp, &mode)) {
+        ALOGE("get mode of display %d fail", disp);
+        return false;
+    }
+
+    if (int(mode.width) <= 16 || int(mode.height) <= 9) {
+        // the driver doesn't return that information
+        // default to 160 dpi
+        mode.width  = ((mode.xres * 25.4f)/160.0f + 0.5f);
+        mode.height = ((mode.yres * 25.4f)/160.0f + 0.5f);
+    }
+
+    display_state_t state = display_ctx->state;
+    if (mode.xres != state.xres
+        || mode.yres != state.yres
+        || mode.width != state.width
+        || mode.height != state.height
+        || (mode.vsync_period > 0 && mode.vsync_period != state.vsync_period)) {
+        state.xdpi = (mode.xres * 25.4f) / mode.width;
+        state.ydpi = (mode.yres * 25.4f) / mode.height;
+
+        state.xres = mode.xres;
+        state.yres = mode.yres;
+        state.width = mode.width;
+        state.height = mode.height;
+        if (mode.vsync_period > 0) state.vsync_period = mode.vsync_period;
+        display_state_publish(display_ctx, &state);
+
+        return true;
     }
     return false;
 }
 
+//called with hwc_mutex held, re-reads the output mode of disp and publishes any change.
+static bool chk_display_mode(hwc_context_1_t* ctx, int disp) {
+    display_context_t* display_ctx = &ctx->display_ctxs[disp];
+    bool changed = false;
+
+    // update vsync period if neccessry
+    int32_t newperiod = chk_output_mode(display_mode_path(disp), display_ctx->mode);
+    if (newperiod > 0 && newperiod != display_ctx->state.vsync_period) {
+        display_state_t state = display_ctx->state;
+        state.vsync_period = newperiod;
+        display_state_publish(display_ctx, &state);
+        changed = true;
+    }
+
+    if (chk_vinfo(ctx, disp)) changed = true;
+    chk_free_scale(ctx, disp);
+    return changed;
+}
+
 static int hwc_device_open(const struct hw_module_t* module, const char* name,
         struct hw_device_t** device);
 
@@ -340,68 +1275,38 @@ static void dump_layer(hwc_layer_1_t const *l) {
 }
 #endif
 
-static void hwc_overlay_compose(hwc_context_1_t *dev, hwc_layer_1_t const* l) {
-    int angle;
-    struct hwc_context_1_t* ctx = (struct hwc_context_1_t*)dev;
-
-#if WITH_LIBPLAYER_MODULE
-    static char last_val[32] = "0";
-    static char last_axis[32] = "0";
-    static char last_mode[32] = {0};
-    static char last_free_scale[32] = {0};
-    static char last_window_axis[50] = {0};
-    bool vpp_changed = false;
-    bool axis_changed = false;
-    bool mode_changed = false;
-    bool free_scale_changed = false;
-    bool window_axis_changed =false;
-
-    if (chk_bool_prop("ro.vout.dualdisplay4")) {
-        vpp_changed = chk_sysfs_status(SYSFS_AMVIDEO_CURIDX, last_val, 32);
-    }
-
-    mode_changed = chk_sysfs_status(SYSFS_DISPLAY_MODE, last_mode, 32);
-
-    free_scale_changed = chk_sysfs_status(SYSFS_FB0_FREE_SCALE, last_free_scale, 32);
-#ifdef SINGLE_EXTERNAL_DISPLAY_USE_FB1
-    if (ctx->display_ctxs[HWC_DISPLAY_EXTERNAL].connected)
-        free_scale_changed = chk_sysfs_status(SYSFS_FB1_FREE_SCALE, last_free_scale, 32);
-#endif
-
-    axis_changed = chk_sysfs_status(SYSFS_VIDEO_AXIS, last_axis, 32);
-    window_axis_changed = chk_sysfs_status(SYSFS_WINDOW_AXIS, last_window_axis, 50);
-
-    if ((ctx->saved_layer == l) &&
-        (ctx->saved_transform == l->transform) &&
-        (ctx->saved_left == l->displayFrame.left) &&
-        (ctx->saved_top == l->displayFrame.top) &&
-        (ctx->saved_right == l->displayFrame.right) &&
-        (ctx->saved_bottom == l->displayFrame.bottom) &&
-        !vpp_changed && !mode_changed && !axis_changed && !free_scale_changed && !window_axis_changed) {
-        return;
-    }
-
-    switch (l->transform) {
+static bool transform_to_angle(uint32_t transform, int* angle) {
+    switch (transform) {
         case 0:
-            angle = 0;
+            *angle = 0;
         break;
         case HAL_TRANSFORM_ROT_90:
-            angle = 90;
+            *angle = 90;
         break;
         case HAL_TRANSFORM_ROT_180:
-            angle = 180;
+            *angle = 180;
         break;
         case HAL_TRANSFORM_ROT_270:
-            angle = 270;
+            *angle = 270;
         break;
         default:
-        return;
+        return false;
     }
+    return true;
+}
 
-    amvideo_utils_set_virtual_position(l->displayFrame.left,
-                   l->displayFrame.top,
-                   l->displayFrame.right - l->displayFrame.left,
-                   l->displayFrame.bottom - l->displayFrame.top,
+#if WITH_LIBPLAYER_MODULE
+//move the video window to frame, false if the transform can't be done by the video layer.
+static bool video_set_axis(hwc_context_1_t* ctx, hwc_rect_t const* frame, uint32_t transform) {
+    int angle;
+
+    if (!transform_to_angle(transform, &angle)) return false;
+
+    HWC_ATRACE_INT("HWC_overlay_axis", ++ctx->overlay_axis_count);
+    amvideo_utils_set_virtual_position(frame->left,
+                   frame->top,
+                   frame->right - frame->left,
+                   frame->bottom - frame->top,
                    angle);
 
     /* the screen mode from Android framework should always be set to normal mode
@@ -409,24 +1314,425 @@ static void hwc_overlay_compose(hwc_context_1_t *dev, hwc_layer_1_t const* l) {
     */
     /*set screen_mode in amvideo_utils_set_virtual_position(),pls check in libplayer*/
     //amvideo_utils_set_screen_mode(0);
+    return true;
+}
 #endif
 
-    ctx->saved_layer = l;
-    ctx->saved_transform = l->transform;
-    ctx->saved_left = l->displayFrame.left;
-    ctx->saved_top = l->displayFrame.top;
-    ctx->saved_right = l->displayFrame.right;
-    ctx->saved_bottom = l->displayFrame.bottom;
+/*
+The pip video layer scales but can't rotate. Its axis is in output
+coordinates, so a frame from a free scaled ui is mapped first; the main
+layer gets that from libplayer, which reads the osd scaler itself.
+*/
+static bool video_set_pip_axis(hwc_context_1_t* ctx, hwc_rect_t const* frame, uint32_t transform) {
+    display_state_t state;
+    hwc_rect_t out = *frame;
+    char axis[64];
+
+    if (transform != 0) return false;
+
+    display_state_read(&ctx->display_ctxs[HWC_DISPLAY_PRIMARY], &state);
+    if (state.xres && state.yres && state.out_xres
+        && (state.out_xres != state.xres || state.out_yres != state.yres)) {
+        out.left = frame->left * (int)state.out_xres / (int)state.xres;
+        out.right = frame->right * (int)state.out_xres / (int)state.xres;
+        out.top = frame->top * (int)state.out_yres / (int)state.yres;
+        out.bottom = frame->bottom * (int)state.out_yres / (int)state.yres;
+    }
+
+    HWC_ATRACE_INT("HWC_overlay_axis", ++ctx->overlay_axis_count);
+    snprintf(axis, sizeof(axis), "%d %d %d %d",
+        out.left, out.top, out.right - 1, out.bottom - 1);
+    return sysfs_write_str(SYSFS_VIDEO_AXIS_PIP, axis) == 0;
+}
 
+/*
+The video window can also be moved behind our back: output mode or osd
+free scale changes, or another client writing the axis. Check for that at
+most every VIDEO_SYSFS_POLL_INTERVAL instead of on every frame.
+*/
+static bool chk_video_sysfs_changed(hwc_context_1_t* ctx) {
 #if WITH_LIBPLAYER_MODULE
-    memset(last_axis, 0, sizeof(last_axis));
+    video_sysfs_state_t* vs = &ctx->video_sysfs;
+    bool changed = false;
+
+    nsecs_t now = systemTime(CLOCK_MONOTONIC);
+    if (now - vs->poll_time < VIDEO_SYSFS_POLL_INTERVAL) return false;
+    vs->poll_time = now;
 
-    if (amsysfs_get_sysfs_str(SYSFS_VIDEO_AXIS, last_axis, sizeof(last_axis)) == 0) {
-        HWC_LOGDB("****last video axis is: %s",last_axis);
+    if (ctx->dualdisplay4) {
+        changed |= chk_sysfs_status(SYSFS_AMVIDEO_CURIDX, vs->last_val, sizeof(vs->last_val));
     }
+
+    changed |= chk_sysfs_status(SYSFS_DISPLAY_MODE, vs->last_mode, sizeof(vs->last_mode));
+
+    if (hwc_policy::fb1_external && display_connected(ctx, HWC_DISPLAY_EXTERNAL))
+        changed |= chk_sysfs_status(SYSFS_FB1_FREE_SCALE, vs->last_free_scale, sizeof(vs->last_free_scale));
+    else
+        changed |= chk_sysfs_status(SYSFS_FB0_FREE_SCALE, vs->last_free_scale, sizeof(vs->last_free_scale));
+
+    bool axis_changed = chk_sysfs_status(SYSFS_VIDEO_AXIS, vs->last_axis, sizeof(vs->last_axis));
+    if (android_atomic_and(0, &vs->axis_resync)) axis_changed = false;
+    changed |= axis_changed;
+    changed |= chk_sysfs_status(SYSFS_WINDOW_AXIS, vs->last_window_axis, sizeof(vs->last_window_axis));
+    return changed;
+#else
+    return false;
 #endif
 }
 
+//identity of a layer that needs a video plane, NULL for any other layer.
+static const void* video_layer_owner(hwc_context_1_t* ctx, int disp, hwc_layer_1_t const* l) {
+    if (l->compositionType == HWC_SIDEBAND) return l->sidebandStream;
+
+    if (l->compositionType == HWC_OVERLAY && l->handle) {
+        hwc_buffer_info_t const* info = buffer_info(ctx, disp, l->handle);
+        if (info && (info->flags & HWC_BUFFER_VIDEO_OVERLAY)) return l->handle;
+    }
+    return NULL;
+}
+
+static int video_plane_find(hwc_context_1_t* ctx, const void* owner) {
+    for (int p = 0; p < ctx->num_video_planes; p++) {
+        if (ctx->video_planes[p].owner == owner) return p;
+    }
+    return -1;
+}
+
+/*
+Called from hwc_prepare. Overlays keep the video plane they already have so
+nothing moves, new overlays take a free plane (main first, then pip), and
+any overlay left over falls back to GLES.
+*/
+static void hwc_assign_video_planes(hwc_context_1_t* ctx,
+        size_t numDisplays, hwc_display_contents_1_t** displays) {
+    bool claimed[VIDEO_PLANE_MAX] = {false};
+    size_t i, j;
+
+    pthread_mutex_lock(&ctx->video_lock);
+    for (i = 0; i < numDisplays; i++) {
+        if (!displays[i]) continue;
+        for (j = 0; j < displays[i]->numHwLayers; j++) {
+            const void* owner = video_layer_owner(ctx, i, &displays[i]->hwLayers[j]);
+            int p = owner ? video_plane_find(ctx, owner) : -1;
+            if (p >= 0) claimed[p] = true;
+        }
+    }
+
+    for (i = 0; i < numDisplays; i++) {
+        if (!displays[i]) continue;
+        for (j = 0; j < displays[i]->numHwLayers; j++) {
+            hwc_layer_1_t* l = &displays[i]->hwLayers[j];
+            const void* owner = video_layer_owner(ctx, i, l);
+            if (!owner || video_plane_find(ctx, owner) >= 0) continue;
+
+            int p = 0;
+            while (p < ctx->num_video_planes && claimed[p]) p++;
+            if (p < ctx->num_video_planes) {
+                HWC_LOGDB("assign video plane %d to %p", p, owner);
+                ctx->video_planes[p].owner = owner;
+                ctx->video_planes[p].state_version = 0;
+                claimed[p] = true;
+            } else if (l->compositionType == HWC_OVERLAY) {
+                HWC_LOGDB("no video plane left for %p, compose with GLES", owner);
+                l->hints &= ~HWC_HINT_CLEAR_FB;
+                l->compositionType = HWC_FRAMEBUFFER;
+            }
+        }
+    }
+
+    for (int p = 0; p < ctx->num_video_planes; p++) {
+        if (!claimed[p]) ctx->video_planes[p].owner = NULL;
+    }
+    pthread_mutex_unlock(&ctx->video_lock);
+}
+
+/*
+Queue the axis of the video plane owned by l for the ui frame this
+hwc_set posts, see hwc_video_post(): the window moves with the hole
+punched in the ui. An unchanged overlay costs nothing, and while a window
+animates only the newest axis reaches the hardware.
+*/
+static bool hwc_overlay_compose(hwc_context_1_t *ctx, int disp, hwc_layer_1_t const* l,
+        uint32_t version, bool force) {
+    const void* owner = video_layer_owner(ctx, disp, l);
+    int p = owner ? video_plane_find(ctx, owner) : -1;
+    if (p < 0) return false;
+
+    video_plane_t* plane = &ctx->video_planes[p];
+    if (plane->state_version == version && !force
+        && plane->transform == l->transform
+        && !memcmp(&plane->frame, &l->displayFrame, sizeof(hwc_rect_t))) {
+        return false;
+    }
+
+    //the pip layer can't rotate, leave the window where it is.
+    if (p == VIDEO_PLANE_PIP && l->transform != 0) return false;
+
+    HWC_ATRACE_CALL();
+    plane->frame = l->displayFrame;
+    plane->transform = l->transform;
+    plane->state_version = version;
+
+    //the virtual display isn't scanned out, its overlays go with the primary's frames.
+    int post_disp = disp < MAX_SUPPORT_DISPLAYS ? disp : HWC_DISPLAY_PRIMARY;
+    pthread_mutex_lock(&ctx->video_lock);
+    if (plane->pending) plane->superseded++;
+    plane->disp = post_disp;
+    plane->pending = true;
+    plane->pending_frame = l->displayFrame;
+    plane->pending_transform = l->transform;
+    plane->requests++;
+    pthread_mutex_unlock(&ctx->video_lock);
+
+    android_atomic_or(1 << post_disp, &ctx->video_post_pending);
+    return true;
+}
+
+//hide planes whose overlay went away in the last prepare.
+static void hwc_release_video_planes(hwc_context_1_t *ctx) {
+    int32_t release = 0;
+
+    pthread_mutex_lock(&ctx->video_lock);
+    for (int p = 0; p < ctx->num_video_planes; p++) {
+        video_plane_t* plane = &ctx->video_planes[p];
+        if (plane->owner) continue;
+
+        plane->pending = false;
+        //forget the request so a new owner always gets its axis applied.
+        plane->state_version = 0;
+        if (plane->active) release |= 1 << plane->disp;
+    }
+    pthread_mutex_unlock(&ctx->video_lock);
+
+    if (release) android_atomic_or(release, &ctx->video_post_pending);
+}
+
+//writes the axis posted with disp's frame, or hides planes that lost their overlay.
+static void hwc_video_apply_locked(hwc_context_1_t *ctx, int disp) {
+    for (int p = 0; p < ctx->num_video_planes; p++) {
+        video_plane_t* plane = &ctx->video_planes[p];
+        if (plane->disp != disp) continue;
+
+        if (!plane->owner) {
+            plane->posted = false;
+            if (plane->active && p == VIDEO_PLANE_PIP) sysfs_write_str(SYSFS_VIDEO_DISABLE_PIP, "1");
+            plane->active = false;
+            continue;
+        }
+        if (!plane->posted) continue;
+        plane->posted = false;
+
+        hwc_rect_t const* frame = &plane->posted_frame;
+        uint32_t transform = plane->posted_transform;
+        bool ok = false;
+        if (p == VIDEO_PLANE_MAIN) {
+#if WITH_LIBPLAYER_MODULE
+            ok = video_set_axis(ctx, frame, transform);
+            if (ok) android_atomic_release_store(1, &ctx->video_sysfs.axis_resync);
+#endif
+        } else {
+            ok = video_set_pip_axis(ctx, frame, transform);
+            if (ok && !plane->active) sysfs_write_str(SYSFS_VIDEO_DISABLE_PIP, "0");
+        }
+        if (!ok) continue;
+
+        HWC_LOGDB("video plane %d axis [%d,%d,%d,%d]", p,
+            frame->left, frame->top, frame->right, frame->bottom);
+        plane->active = true;
+        plane->applied_frame = *frame;
+        plane->applied_transform = transform;
+        plane->applied++;
+    }
+}
+
+//waiter thread: the frame's gpu work is done, it flips at the next vsync.
+static void hwc_video_fence_done(hwc_fence_watch_t const* watch) {
+    hwc_context_1_t* ctx = (hwc_context_1_t*)watch->data;
+
+    //a stuck frame stays watched, its axis waits with it.
+    if (watch->fence.status == HWC_FENCE_TIMEOUT) return;
+
+    pthread_mutex_lock(&ctx->video_lock);
+    for (int i = 0; i < MAX_SUPPORT_DISPLAYS; i++) {
+        display_context_t* display_ctx = &ctx->display_ctxs[i];
+        //a later frame of the display took over, its own fence applies.
+        if (display_ctx->video_fence != watch->fence.fd) continue;
+        display_ctx->video_fence = -1;
+        hwc_video_apply_locked(ctx, i);
+    }
+    pthread_mutex_unlock(&ctx->video_lock);
+}
+
+/*
+Called once disp's frame was handed to the display, with a copy of its
+acquire fence, which this takes, or -1. The osd flips to the frame at the
+first vsync after the fence signals, and the vpp latches an axis written
+before that vsync at the same one: writing the frame's axis as soon as
+the fence signaled keeps the video window in step with the ui. Not done
+on the vsync thread, whose software timer has no fixed phase to the
+hardware vsync. A frame superseded before its fence signaled applies
+nothing, the newest axis goes with the newest frame.
+*/
+static void hwc_video_post(hwc_context_1_t *ctx, int disp, int fence) {
+    display_context_t* display_ctx = &ctx->display_ctxs[disp];
+
+    android_atomic_and(~(1 << disp), &ctx->video_post_pending);
+    pthread_mutex_lock(&ctx->video_lock);
+    for (int p = 0; p < ctx->num_video_planes; p++) {
+        video_plane_t* plane = &ctx->video_planes[p];
+        if (plane->disp != disp || !plane->pending) continue;
+
+        if (plane->posted) plane->superseded++;
+        plane->posted = true;
+        plane->posted_frame = plane->pending_frame;
+        plane->posted_transform = plane->pending_transform;
+        plane->pending = false;
+    }
+    display_ctx->video_fence = -1;
+    if (fence < 0 || !ctx->fence_thread_running || sync_wait(fence, 0) == 0) {
+        hwc_video_apply_locked(ctx, disp);
+        pthread_mutex_unlock(&ctx->video_lock);
+        if (fence >= 0) close(fence);
+        return;
+    }
+    display_ctx->video_fence = fence;
+    pthread_mutex_unlock(&ctx->video_lock);
+
+    if (hwc_fence_watch(&ctx->fence_waiter, fence, systemTime(CLOCK_MONOTONIC),
+            hwc_video_fence_done, ctx)) {
+        //the waiter is full and closed it, don't leave the axis behind.
+        pthread_mutex_lock(&ctx->video_lock);
+        if (display_ctx->video_fence == fence) {
+            display_ctx->video_fence = -1;
+            hwc_video_apply_locked(ctx, disp);
+        }
+        pthread_mutex_unlock(&ctx->video_lock);
+    }
+}
+
+/*
+Sideband content (tuner, hdmi-in) is routed to the video layer by its
+producer, the HAL only positions the video plane the stream was assigned.
+That is redone only when SurfaceFlinger flags a geometry change or the
+display mode changes, a live stream costs nothing per frame.
+*/
+static bool hwc_sideband_compose(hwc_context_1_t *ctx, int disp,
+        hwc_display_contents_1_t* contents, hwc_rect_t* axis) {
+    display_context_t* display_ctx = &ctx->display_ctxs[disp];
+    display_state_t state;
+
+    display_state_read(display_ctx, &state);
+    uint32_t version = state.version;
+    if (!(contents->flags & HWC_GEOMETRY_CHANGED) && version == display_ctx->sideband_version) {
+        return false;
+    }
+    display_ctx->sideband_version = version;
+
+    bool applied = false;
+    for (size_t j = 0; j < contents->numHwLayers; j++) {
+        hwc_layer_1_t const* l = &contents->hwLayers[j];
+        if (l->compositionType == HWC_SIDEBAND && l->sidebandStream
+            && hwc_overlay_compose(ctx, disp, l, version, false)) {
+            *axis = l->displayFrame;
+            applied = true;
+        }
+    }
+    return applied;
+}
+
+static char composition_type_char(int32_t type) {
+    switch (type) {
+        case HWC_FRAMEBUFFER:           return 'G';
+        case HWC_OVERLAY:               return 'O';
+        case HWC_BACKGROUND:            return 'B';
+        case HWC_FRAMEBUFFER_TARGET:    return 'T';
+        case HWC_SIDEBAND:              return 'S';
+        case HWC_CURSOR_OVERLAY:        return 'C';
+        default:                        return '?';
+    }
+}
+
+/*
+Each record is its own seqlock: a writer claims the next slot with one atomic
+increment and never waits, a reader skips any slot that changed while it was
+being copied. Cheap enough to stay on in production.
+*/
+static void hwc_frame_log_write(hwc_frame_log_t *log, const hwc_frame_record_t *rec) {
+    int32_t idx = android_atomic_inc(&log->head) & (HWC_FRAME_LOG_SIZE - 1);
+    hwc_frame_record_t *slot = &log->records[idx];
+
+    int32_t seq = android_atomic_inc(&slot->seq) + 1;
+    android_memory_barrier();
+    memcpy((char *)slot + sizeof(slot->seq), (const char *)rec + sizeof(rec->seq),
+            sizeof(hwc_frame_record_t) - sizeof(rec->seq));
+    android_atomic_release_store(seq + 1, &slot->seq);
+}
+
+static bool hwc_frame_log_read(hwc_frame_log_t *log, int32_t idx, hwc_frame_record_t *rec) {
+    hwc_frame_record_t *slot = &log->records[idx & (HWC_FRAME_LOG_SIZE - 1)];
+
+    int32_t seq = android_atomic_acquire_load(&slot->seq);
+    if (seq == 0 || (seq & 1)) return false;
+    memcpy(rec, slot, sizeof(hwc_frame_record_t));
+    android_memory_barrier();
+    return android_atomic_acquire_load(&slot->seq) == seq;
+}
+
+static void hwc_frame_log_record(hwc_context_1_t *pdev, int disp,
+        hwc_display_contents_1_t* contents, int post_err, nsecs_t set_time,
+        nsecs_t post_ns, bool axis_applied, hwc_rect_t const* axis) {
+    hwc_frame_record_t rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.frame = pdev->frame_count;
+    rec.disp = disp;
+    rec.num_layers = contents->numHwLayers;
+    rec.release_fence = -1;
+    for (size_t j = 0; j < contents->numHwLayers; j++) {
+        hwc_layer_1_t const* l = &contents->hwLayers[j];
+        if (j < HWC_FRAME_LOG_MAX_LAYERS) rec.types[j] = composition_type_char(l->compositionType);
+        if (l->compositionType == HWC_FRAMEBUFFER_TARGET) rec.release_fence = l->releaseFenceFd;
+    }
+    rec.axis_applied = axis_applied;
+    if (axis_applied) rec.axis = *axis;
+    rec.post_err = post_err;
+    rec.retire_fence = contents->retireFenceFd;
+    rec.set_time = set_time;
+    rec.prepare_ns = pdev->prepare_ns;
+    rec.post_ns = post_ns;
+    //the virtual display has no context of its own.
+    if (disp < MAX_SUPPORT_DISPLAYS) {
+        rec.scan_bytes = pdev->display_ctxs[disp].scan_bytes;
+        rec.ddr_bytes = pdev->display_ctxs[disp].cost.total;
+    }
+
+    hwc_frame_log_write(&pdev->frame_log, &rec);
+}
+
+static void hwc_frame_log_dump(hwc_frame_log_t *log, android::String8& result) {
+    result.append("  Recent frames (types: G=GLES O=overlay B=background T=fb target S=sideband C=cursor)\n");
+    result.append("    frame | disp | layers           | axis                      | post | rel | ret | prepare us | post us | scan KB | ddr KB\n");
+    result.append("    ------+------+------------------+---------------------------+------+-----+-----+------------+---------+---------+-------\n");
+
+    int32_t head = android_atomic_acquire_load(&log->head);
+    int32_t first = head > HWC_FRAME_LOG_SIZE ? head - HWC_FRAME_LOG_SIZE : 0;
+    for (int32_t i = first; i < head; i++) {
+        hwc_frame_record_t rec;
+        if (!hwc_frame_log_read(log, i, &rec)) continue;
+
+        char axis[32] = "-";
+        if (rec.axis_applied) {
+            snprintf(axis, sizeof(axis), "[%d,%d,%d,%d]",
+                rec.axis.left, rec.axis.top, rec.axis.right, rec.axis.bottom);
+        }
+        result.appendFormat("    %5u | %4d | %-16s | %-25s | %4d | %3d | %3d | %10lld | %7lld | %7u | %6llu\n",
+            rec.frame, rec.disp, rec.types, axis, rec.post_err,
+            rec.release_fence, rec.retire_fence,
+            (long long)ns2us(rec.prepare_ns), (long long)ns2us(rec.post_ns),
+            rec.scan_bytes / 1024, (unsigned long long)(rec.ddr_bytes / 1024));
+    }
+}
+
 static void hwc_dump(hwc_composer_device_1* dev, char *buff, int buff_len) {
     if (buff_len <= 0) return;
 
@@ -436,26 +1742,119 @@ static void hwc_dump(hwc_composer_device_1* dev, char *buff, int buff_len) {
 
     for (int i = 0; i < MAX_SUPPORT_DISPLAYS; i++) {
         get_display_info(pdev,i);
+        display_state_t state;
+        display_state_read(display_ctx, &state);
 
-        if (display_ctx->connected) {
+        if (state.connected) {
             result.appendFormat("  %8s Display connected: %3s\n",
-                HWC_DISPLAY_EXTERNAL == i ? "External":"Primiary", display_ctx->connected ? "Yes" : "No");
-                result.appendFormat("    w=%u, h=%u, xdpi=%f, ydpi=%f, osdIdx=%d, vsync_period=%d, video_buf_used: %s\n",
-                fbinfo->info.xres,
-                fbinfo->info.yres,
-                fbinfo->xdpi,
-                fbinfo->ydpi,
+                HWC_DISPLAY_EXTERNAL == i ? "External":"Primiary", state.connected ? "Yes" : "No");
+                result.appendFormat("    w=%u, h=%u, output=%ux%u, xdpi=%f, ydpi=%f, osdIdx=%d, vsync_period=%d, state_version=%u, video_buf_used: %s\n",
+                state.xres,
+                state.yres,
+                state.out_xres,
+                state.out_yres,
+                state.xdpi,
+                state.ydpi,
                 fbinfo->fbIdx,
-                pdev->vsync_period,
+                state.vsync_period,
+                state.version,
                 pdev->video_buf_used);
+            result.appendFormat("    afbc: capable=%d, enabled=%d, rejected=%u\n",
+                display_ctx->afbc_capable, display_ctx->afbc_enabled, display_ctx->afbc_rejected);
+            result.appendFormat("    direct scanout: layer=%d, frames=%u\n",
+                display_ctx->direct_layer, display_ctx->direct_frames);
+            if (display_ctx->fb_buffers) {
+                result.appendFormat("    framebuffer: buffers=%u, memory=%uKB, stalls=%u of %u frames\n",
+                    display_ctx->fb_buffers, display_ctx->fb_bytes / 1024,
+                    display_ctx->fb_stalls, display_ctx->frames_posted);
+            }
+            hwc_frame_cost_t const* cost = &display_ctx->cost;
+            result.appendFormat("    ddr estimate: %lluKB/frame = gles %llu/%llu, cursor %llu, video %llu, "
+                "direct %llu, fb target %llu/%llu (KB read/written), %lluMB/s, over threshold=%u\n",
+                (unsigned long long)(cost->total / 1024),
+                (unsigned long long)(cost->paths[HWC_PATH_GLES].read / 1024),
+                (unsigned long long)(cost->paths[HWC_PATH_GLES].write / 1024),
+                (unsigned long long)(cost->paths[HWC_PATH_OSD].read / 1024),
+                (unsigned long long)(cost->paths[HWC_PATH_VIDEO].read / 1024),
+                (unsigned long long)(cost->paths[HWC_PATH_DIRECT].read / 1024),
+                (unsigned long long)(cost->fb_target.read / 1024),
+                (unsigned long long)(cost->fb_target.write / 1024),
+                (unsigned long long)(hwc_cost_rate(cost, state.vsync_period) >> 20),
+                display_ctx->over_threshold);
+            hwc_deadline_t* dl = &display_ctx->deadlines;
+            result.appendFormat("    deadlines: on time=%u, late=%u (sf=%u, fence=%u, post=%u, display=%u), dropped=%u\n",
+                dl->on_time,
+                dl->late[HWC_LATE_SF] + dl->late[HWC_LATE_FENCE] + dl->late[HWC_LATE_POST] + dl->late[HWC_LATE_DISPLAY],
+                dl->late[HWC_LATE_SF], dl->late[HWC_LATE_FENCE], dl->late[HWC_LATE_POST],
+                dl->late[HWC_LATE_DISPLAY], dl->dropped);
+            static const int64_t fence_bounds_us[] = HWC_TELEMETRY_FENCE_BOUNDS_US;
+            hwc_fence_stats_t* fs = &display_ctx->fence_stats;
+            result.appendFormat("    fences: posted=%u, pending=%u, timeouts=%u, errors=%u, max=%lldus, stuck now=%d, frames dropped=%u\n      time to signal:",
+                fs->waits, fs->blocked, fs->timeouts, fs->errors, (long long)ns2us(fs->max_ns),
+                android_atomic_acquire_load(&display_ctx->fences_stuck), display_ctx->stuck_drops);
+            for (int b = 0; b < HWC_TELEMETRY_FENCE_BUCKETS; b++) {
+                if (b < HWC_TELEMETRY_FENCE_BUCKETS - 1) {
+                    result.appendFormat(" <%lldus=%u", (long long)fence_bounds_us[b], fs->hist[b]);
+                } else {
+                    result.appendFormat(" more=%u\n", fs->hist[b]);
+                }
+            }
+            result.appendFormat("    link: %s, frames dropped while down=%u\n",
+                hwc_link_is_down(display_ctx) ? "down" : "up", display_ctx->link_drops);
+            hwc_buffer_cache_t* cache = &pdev->buffer_caches[i];
+            result.appendFormat("    buffer cache: hits=%u, misses=%u, evictions=%u\n",
+                cache->hits, cache->misses, cache->evictions);
+            if (hwc_policy::cursor_layer) {
+                cursor_context_t* cursor_ctx = &(display_ctx->cursor_ctx);
+                int32_t requests = android_atomic_acquire_load(&cursor_ctx->pos_requests);
+                result.appendFormat("    cursor position updates: requested=%d, applied=%d, coalesced=%d\n",
+                    requests, cursor_ctx->pos_applied, requests - cursor_ctx->pos_applied);
+            }
         }
     }
 
-    //result.append(
-    //        "   type   |  handle  |  color   | blend | format |   position    |     size      | gsc \n"
-    //        "----------+----------|----------+-------+--------+---------------+---------------------\n");
-    //        8_______ | 8_______ | 8_______ | 5____ | 6_____ | [5____,5____] | [5____,5____] | 3__ \n"
+    pthread_mutex_lock(&pdev->video_lock);
+    for (int p = 0; p < pdev->num_video_planes; p++) {
+        video_plane_t* plane = &pdev->video_planes[p];
+        result.appendFormat("  video plane %-4s: owner=%p, active=%d, axis=[%d,%d,%d,%d], transform=%u\n",
+            p == VIDEO_PLANE_MAIN ? "main" : "pip", plane->owner, plane->active,
+            plane->applied_frame.left, plane->applied_frame.top,
+            plane->applied_frame.right, plane->applied_frame.bottom, plane->applied_transform);
+        result.appendFormat("    axis updates: requested=%u, applied=%u, superseded=%u\n",
+            plane->requests, plane->applied, plane->superseded);
+    }
+    pthread_mutex_unlock(&pdev->video_lock);
+
+    result.appendFormat("  backend: %s, background: 0x%06x, ddr threshold: %lluMB/s, fence timeout: %dms\n",
+        pdev->backend.ops->name, pdev->bg_applied, (unsigned long long)(pdev->ddr_threshold >> 20),
+        pdev->fence_timeout_ms);
+    nsecs_t cursor_ready = pdev->display_ctxs[HWC_DISPLAY_PRIMARY].cursor_ready_time;
+    result.appendFormat("  startup: open=%lldus, first vsync=%lldus, cursor ready=%lldus after open\n",
+        (long long)ns2us(pdev->open_ns),
+        pdev->first_vsync_time ? (long long)ns2us(pdev->first_vsync_time - pdev->open_time) : -1LL,
+        cursor_ready ? (long long)ns2us(cursor_ready - pdev->open_time) : -1LL);
+    for (int t = 0; t < HWC_THREAD_MAX; t++) {
+        hwc_thread_sched_t* sched = &pdev->thread_sched[t];
+        if (!sched->name) continue;
+        result.appendFormat("  thread %-8s: tid=%d, %s %d, cpus=0x%x%s, slack=%d\n",
+            sched->name, sched->tid, sched->policy == SCHED_FIFO ? "fifo" : "nice",
+            sched->policy == SCHED_FIFO ? sched->fifo : sched->nice,
+            sched->cpus, sched->cpus && !sched->affinity_set ? "(refused)" : "", sched->slack_ns);
+    }
+    static const int64_t wake_bounds_us[] = HWC_TELEMETRY_WAKE_BOUNDS_US;
+    hwc_telemetry_vsync_t* vsync_stats = &pdev->vsync_stats;
+    result.append("  vsync wakeup lateness:");
+    for (int b = 0; b < HWC_TELEMETRY_WAKE_BUCKETS; b++) {
+        if (b < HWC_TELEMETRY_WAKE_BUCKETS - 1) {
+            result.appendFormat(" <%lldus=%u", (long long)wake_bounds_us[b], vsync_stats->wake_hist[b]);
+        } else {
+            result.appendFormat(" more=%u", vsync_stats->wake_hist[b]);
+        }
+    }
+    result.appendFormat(", max=%lldus\n", (long long)ns2us(vsync_stats->wake_max_ns));
 
+    result.append("\n");
+    hwc_frame_log_dump(&pdev->frame_log, result);
     result.append("\n");
 
     strlcpy(buff, result.string(), buff_len);
@@ -489,7 +1888,7 @@ static int hwc_query(struct hwc_composer_device_1* dev, int what, int *value) {
         break;
         case HWC_VSYNC_PERIOD:
             // vsync period in nanosecond
-            value[0] = pdev->vsync_period;
+            value[0] = display_vsync_period(pdev, HWC_DISPLAY_PRIMARY);
         break;
         default:
             // unsupported query
@@ -500,6 +1899,21 @@ static int hwc_query(struct hwc_composer_device_1* dev, int what, int *value) {
     return 0;
 }
 
+//wake the vsync thread if it sleeps with vsync disabled, the hotplug thread may wait too.
+static void hwc_vsync_kick() {
+    pthread_mutex_lock(&hwc_mutex);
+    pthread_cond_broadcast(&hwc_cond);
+    pthread_mutex_unlock(&hwc_mutex);
+}
+
+//queue work for the next vsync, waking the vsync thread if it has nothing else to do.
+static void hwc_latch(hwc_context_1_t* ctx, int32_t bits) {
+    int32_t old = android_atomic_or(bits, &ctx->latch_pending);
+    if (!old && !android_atomic_acquire_load(&ctx->vsync_enable)) {
+        hwc_vsync_kick();
+    }
+}
+
 static int hwc_eventControl(struct hwc_composer_device_1* dev,
                             int,
                             int event,
@@ -509,15 +1923,137 @@ static int hwc_eventControl(struct hwc_composer_device_1* dev,
     switch (event)
     {
         case HWC_EVENT_VSYNC:
-            ctx->vsync_enable = enabled;
-            pthread_mutex_lock(&hwc_mutex);
-            pthread_cond_signal(&hwc_cond);
-            pthread_mutex_unlock(&hwc_mutex);
+            android_atomic_release_store(enabled, &ctx->vsync_enable);
+            hwc_vsync_kick();
         return 0;
     }
     return -EINVAL;
 }
 
+/*
+A frame whose only layer is an opaque full screen buffer, a game or a boot
+animation, can be scanned out as is instead of having the GPU copy it into
+the fb target. Only on backends that can import the buffer, the DRM one:
+fbdev can't. That always moves less: the osd fetches the layer instead
+of the fb target, and the GPU read and write are gone. The backend has
+the last word through test(); its answer is kept with the buffer until
+the geometry changes.
+*/
+static int hwc_direct_scanout_layer(hwc_context_1_t* ctx, int disp,
+        hwc_display_contents_1_t* contents) {
+    if (disp >= HWC_DISPLAY_VIRTUAL || contents->numHwLayers != 2) return -1;
+    hwc_backend_t* be = &ctx->backend;
+    if (!(be->ops->caps(be, disp) & HWC_BACKEND_CAP_TEST)) return -1;
+
+    hwc_layer_1_t* l = &contents->hwLayers[0];
+    if (l->compositionType != HWC_FRAMEBUFFER || (l->flags & HWC_SKIP_LAYER)) return -1;
+
+    hwc_buffer_info_t* info = buffer_info(ctx, disp, l->handle);
+    if (!info || (info->flags & (HWC_BUFFER_VIDEO_OVERLAY | HWC_BUFFER_OSD_VIDEO_OMX))) return -1;
+
+    display_context_t* display_ctx = &ctx->display_ctxs[disp];
+    display_state_t state;
+    display_state_read(display_ctx, &state);
+    if (l->transform != 0 || l->planeAlpha != 0xFF
+        || (l->blending != HWC_BLENDING_NONE && !(info->flags & HWC_BUFFER_OPAQUE))
+        || l->displayFrame.left != 0 || l->displayFrame.top != 0
+        || l->displayFrame.right != (int)state.xres || l->displayFrame.bottom != (int)state.yres) {
+        return -1;
+    }
+    //posts are always full size, unscaled.
+    hwc_frect_t const* crop = &l->sourceCropf;
+    if (info->width != (int)state.xres || info->height != (int)state.yres
+        || crop->left != 0 || crop->top != 0
+        || crop->right != info->width || crop->bottom != info->height) {
+        return -1;
+    }
+    if ((info->flags & HWC_BUFFER_AFBC) && !display_ctx->afbc_capable) return -1;
+
+    if ((contents->flags & HWC_GEOMETRY_CHANGED) || info->scanout == HWC_SCANOUT_UNKNOWN) {
+        info->scanout = be->ops->test(be, disp, l) == 0
+            ? HWC_SCANOUT_YES : HWC_SCANOUT_NO;
+    }
+    return info->scanout == HWC_SCANOUT_YES ? 0 : -1;
+}
+
+/*
+The vpp fills whatever no plane covers with its background color. A
+HWC_BACKGROUND layer at the bottom of the primary stack becomes that
+color instead of a full screen GLES fill; the ui drawn above it is
+cleared to transparent and blends over it in the osd. Solid layers
+without buffer stay with GLES: HWC 1.x doesn't say their color.
+*/
+static int32_t hwc_prepare_background(hwc_context_1_t* ctx, int disp,
+        hwc_display_contents_1_t* contents) {
+    int32_t color = HWC_BACKGROUND_BLACK;
+    size_t j;
+
+    for (j = 0; j < contents->numHwLayers; j++) {
+        hwc_layer_1_t* l = &contents->hwLayers[j];
+        if (l->compositionType != HWC_BACKGROUND) continue;
+
+        if (disp != HWC_DISPLAY_PRIMARY || j != 0) {
+            l->compositionType = HWC_FRAMEBUFFER;
+            continue;
+        }
+        color = (l->backgroundColor.r << 16) | (l->backgroundColor.g << 8) | l->backgroundColor.b;
+    }
+    return color;
+}
+
+/*
+Traffic of the assignment hwc_prepare settled on, for dumpsys, the frame
+log and systrace, and to count frames over HWC_PROP_DDR_THRESHOLD. It
+doesn't feed back into the assignment.
+*/
+static void hwc_prepare_cost(hwc_context_1_t* ctx, int disp, hwc_display_contents_1_t* contents) {
+    display_context_t* display_ctx = &ctx->display_ctxs[disp];
+    hwc_frame_cost_t* cost = &display_ctx->cost;
+    bool gles_pass = false;
+
+    memset(cost, 0, sizeof(hwc_frame_cost_t));
+    for (size_t j = 0; j < contents->numHwLayers; j++) {
+        hwc_layer_1_t const* l = &contents->hwLayers[j];
+        int path;
+
+        switch (l->compositionType) {
+            case HWC_FRAMEBUFFER:
+                if (l->flags & HWC_SKIP_LAYER) continue;
+                path = HWC_PATH_GLES;
+                gles_pass = true;
+                break;
+            case HWC_CURSOR_OVERLAY:
+                path = HWC_PATH_OSD;
+                break;
+            case HWC_SIDEBAND:
+                path = HWC_PATH_VIDEO;
+                break;
+            case HWC_BACKGROUND:
+                path = HWC_PATH_BACKGROUND;
+                break;
+            case HWC_OVERLAY:
+                path = (int)j == display_ctx->direct_layer ? HWC_PATH_DIRECT : HWC_PATH_VIDEO;
+                break;
+            default:
+                continue;
+        }
+        hwc_buffer_info_t const* info = l->handle && path != HWC_PATH_VIDEO
+            ? buffer_info(ctx, disp, l->handle) : NULL;
+        hwc_cost_frame_add(cost, path, hwc_cost_layer(path, l, info));
+    }
+
+    display_state_t state;
+    display_state_read(display_ctx, &state);
+    hwc_cost_frame_finish(cost, state.xres, state.yres, display_ctx->fb_afbc,
+            gles_pass, display_ctx->direct_layer < 0);
+
+    if (ctx->ddr_threshold && hwc_cost_rate(cost, state.vsync_period) > ctx->ddr_threshold) {
+        display_ctx->over_threshold++;
+        HWC_LOGVB("disp %d: %llu bytes per frame over threshold", disp, (unsigned long long)cost->total);
+    }
+    HWC_ATRACE_INT(disp == HWC_DISPLAY_PRIMARY ? "HWC_ddr_kb" : "HWC_ddr_kb_ext", cost->total / 1024);
+}
+
 static int hwc_prepare(struct hwc_composer_device_1 *dev,
                        size_t numDisplays,
                        hwc_display_contents_1_t** displays) {
@@ -529,92 +2065,394 @@ static int hwc_prepare(struct hwc_composer_device_1 *dev,
     if (!numDisplays || !displays) return 0;
 
     LOG_FUNCTION_NAME
+    HWC_ATRACE_CALL();
+    nsecs_t prepare_start = systemTime(CLOCK_MONOTONIC);
+    if (hwc_trace_enabled(&pdev->trace)) {
+        hwc_trace_record(&pdev->trace, HWC_TRACE_CALL_PREPARE, numDisplays, displays);
+    }
+
+    for (i = 0; i < HWC_NUM_DISPLAY_TYPES; i++) {
+        hwc_buffer_cache_next_frame(&pdev->buffer_caches[i]);
+    }
+
     //retireFenceFd will close in surfaceflinger, just reset it.
     for (i = 0; i < numDisplays; i++) {
-        CHK_SKIP_DISPLAY_FB0();
+        CHK_SKIP_DISPLAY_FB0(i);
 
         display_content = displays[i];
         if ( display_content ) {
             display_content->retireFenceFd = -1;
+            bool cursor_osd = hwc_policy::cursor_layer
+                && (pdev->backend.ops->caps(&pdev->backend, i) & HWC_BACKEND_CAP_CURSOR);
             for (size_t j=0 ; j< display_content->numHwLayers ; j++) {
                 hwc_layer_1_t* l = &display_content->hwLayers[j];
+                hwc_buffer_info_t const* info = l->handle ? buffer_info(pdev, i, l->handle) : NULL;
 
-#ifdef ENABLE_CURSOR_LAYER
-                if (l->flags & HWC_IS_CURSOR_LAYER) {
+                //the cursor is copied to its osd as is, leave compressed ones to GLES.
+                if (cursor_osd && (l->flags & HWC_IS_CURSOR_LAYER)
+                    && !(info && (info->flags & HWC_BUFFER_AFBC))) {
                     l->hints = HWC_HINT_CLEAR_FB;
                     HWC_LOGDA("This is a Cursor layer");
                     l->compositionType = HWC_CURSOR_OVERLAY;
                     continue;
                 }
-#endif
 
                 if (l->compositionType == HWC_SIDEBAND && l->sidebandStream) {
-                    //TODO: we just transact SIDEBAND to OVERLAY now;
-                    HWC_LOGVA("get HWC_SIDEBAND layer, just change to overlay");
+                    //the stream feeds the video path directly, see hwc_sideband_compose().
+                    HWC_LOGVA("get HWC_SIDEBAND layer");
                     l->hints = HWC_HINT_CLEAR_FB;
-                    l->compositionType = HWC_OVERLAY;
                     continue;
                 }
 
-                if (l->handle) {
-                    private_handle_t const* hnd = reinterpret_cast<private_handle_t const*>(l->handle);
-                    if (hnd->flags & private_handle_t::PRIV_FLAGS_OSD_VIDEO_OMX) {
-                        l->hints = HWC_HINT_OSD_VIDEO_OMX;
-                    }
-                    if (hnd->flags & private_handle_t::PRIV_FLAGS_VIDEO_OVERLAY) {
-                        l->hints = HWC_HINT_CLEAR_FB;
-                        l->compositionType = HWC_OVERLAY;
-                        continue;
-                    }
-                }
+                if (info) {
+                    if (info->flags & HWC_BUFFER_OSD_VIDEO_OMX) {
+                        l->hints = HWC_HINT_OSD_VIDEO_OMX;
+                    }
+                    if (info->flags & HWC_BUFFER_VIDEO_OVERLAY) {
+                        l->hints = HWC_HINT_CLEAR_FB;
+                        l->compositionType = HWC_OVERLAY;
+                        continue;
+                    }
+                }
+            }
+        }
+    }
+
+    for (i = 0; i < numDisplays && i < MAX_SUPPORT_DISPLAYS; i++) {
+        display_context_t* display_ctx = &pdev->display_ctxs[i];
+        int last = display_ctx->direct_layer;
+        display_ctx->direct_layer = -1;
+        //SurfaceFlinger resets compositionType only on geometry changes, last frame's pick still says overlay.
+        if (last >= 0 && displays[i] && !(displays[i]->flags & HWC_GEOMETRY_CHANGED)
+            && last < (int)displays[i]->numHwLayers) {
+            hwc_layer_1_t* l = &displays[i]->hwLayers[last];
+            hwc_buffer_info_t const* info = l->handle ? buffer_info(pdev, i, l->handle) : NULL;
+            if (l->compositionType == HWC_OVERLAY
+                && !(info && (info->flags & HWC_BUFFER_VIDEO_OVERLAY))) {
+                l->compositionType = HWC_FRAMEBUFFER;
+            }
+        }
+        CHK_SKIP_DISPLAY_FB0(i);
+
+        display_ctx->direct_layer = displays[i] ? hwc_direct_scanout_layer(pdev, i, displays[i]) : -1;
+        if (display_ctx->direct_layer >= 0) {
+            hwc_layer_1_t* l = &displays[i]->hwLayers[display_ctx->direct_layer];
+            l->hints = 0;
+            l->compositionType = HWC_OVERLAY;
+        }
+    }
+
+    hwc_assign_video_planes(pdev, numDisplays, displays);
+
+    pdev->bg_color = HWC_BACKGROUND_BLACK;
+    for (i = 0; i < numDisplays; i++) {
+        CHK_SKIP_DISPLAY_FB0(i);
+        if (!displays[i]) continue;
+        int32_t color = hwc_prepare_background(pdev, i, displays[i]);
+        if (i == HWC_DISPLAY_PRIMARY) pdev->bg_color = color;
+    }
+
+    for (i = 0; i < numDisplays && i < MAX_SUPPORT_DISPLAYS; i++) {
+        CHK_SKIP_DISPLAY_FB0(i);
+        if (displays[i]) hwc_prepare_cost(pdev, i, displays[i]);
+    }
+
+    pdev->prepare_time = prepare_start;
+    pdev->prepare_ns = systemTime(CLOCK_MONOTONIC) - prepare_start;
+    LOG_FUNCTION_NAME_EXIT
+    return 0;
+}
+
+static nsecs_t hwc_vsync_edge(hwc_context_1_t* ctx) {
+    int32_t seq;
+    nsecs_t edge;
+
+    do {
+        seq = android_atomic_acquire_load(&ctx->vsync_edge_seq);
+        edge = ctx->vsync_edge;
+        android_memory_barrier();
+    } while ((seq & 1) || seq != android_atomic_acquire_load(&ctx->vsync_edge_seq));
+    return edge;
+}
+
+/*
+A frame is meant for the vsync after the one SurfaceFlinger started it on,
+the last edge at or before prepare. The edges are the display's own flips,
+when a release fence signaled, so each display has its phase and the
+software vsync timer doesn't skew it. Until a flip was seen at the current
+period the vsync thread's edge stands in. The last edge is carried forward
+by whole periods.
+*/
+static nsecs_t hwc_frame_deadline(hwc_context_1_t* ctx, int disp) {
+    display_context_t* display_ctx = &ctx->display_ctxs[disp];
+    nsecs_t period = display_vsync_period(ctx, disp);
+    nsecs_t edge = display_ctx->flip_period == period ? display_ctx->flip_edge : 0;
+    nsecs_t start = ctx->prepare_time;
+
+    if (!edge) edge = hwc_vsync_edge(ctx);
+    if (!edge || period <= 0 || !start) return 0;
+    if (start > edge) edge += (start - edge) / period * period;
+    return edge + period;
+}
+
+//when fd signaled, 0 if it hasn't or can't tell.
+static nsecs_t fence_signal_time(int fd) {
+    struct sync_fence_info_data* info = sync_fence_info(fd);
+    if (!info) return 0;
+
+    nsecs_t signaled = 0;
+    struct sync_pt_info* pt = NULL;
+    while ((pt = sync_pt_info(info, pt)) != NULL) {
+        if (pt->status == 1 && (nsecs_t)pt->timestamp_ns > signaled) signaled = pt->timestamp_ns;
+    }
+    sync_fence_info_free(info);
+    return signaled;
+}
+
+static void hwc_deadline_release(hwc_deadline_frame_t* frame) {
+    if (frame->acquire_fence >= 0) close(frame->acquire_fence);
+    if (frame->release_fence >= 0) close(frame->release_fence);
+    frame->acquire_fence = frame->release_fence = -1;
+}
+
+/*
+Shown more than half a period after its deadline is late, blamed on the
+first stage that missed it. A frame replaced within half a period of
+being shown was never really seen and counts as dropped instead.
+*/
+static void hwc_deadline_classify(hwc_deadline_t* dl, hwc_deadline_frame_t* frame,
+        hwc_deadline_frame_t* prev, nsecs_t period, int disp) {
+    nsecs_t acquired = frame->acquire_fence >= 0 ? fence_signal_time(frame->acquire_fence) : 0;
+
+    frame->late = -1;
+    if (frame->shown > frame->deadline + period / 2) {
+        if (frame->set_time > frame->deadline) frame->late = HWC_LATE_SF;
+        else if (acquired > frame->deadline) frame->late = HWC_LATE_FENCE;
+        else if (frame->post_done > frame->deadline) frame->late = HWC_LATE_POST;
+        else frame->late = HWC_LATE_DISPLAY;
+        dl->late[frame->late]++;
+        HWC_LOGDB("disp %d: frame shown %lldus late, cause %d", disp,
+            (long long)ns2us(frame->shown - frame->deadline), frame->late);
+    } else {
+        dl->on_time++;
+    }
+
+    if (prev && prev->shown && frame->shown - prev->shown < period / 2) {
+        if (prev->late < 0) dl->on_time--;
+        else dl->late[prev->late]--;
+        dl->dropped++;
+    }
+}
+
+/*
+Called after each post. The release fence of a frame signals when the next
+one is shown, so a frame is classified once its predecessor's release
+fence has signaled. Frames the display never lets go of, blanked or
+disconnected, are given up on when the ring fills.
+*/
+static void hwc_deadline_track(hwc_context_1_t* ctx, int disp, int acquire_fence, int release_fence) {
+    display_context_t* display_ctx = &ctx->display_ctxs[disp];
+    hwc_deadline_t* dl = &display_ctx->deadlines;
+    nsecs_t period = display_vsync_period(ctx, disp);
+
+    if (!display_ctx->frame_deadline || period <= 0) {
+        if (acquire_fence >= 0) close(acquire_fence);
+        return;
+    }
+
+    if (dl->head - dl->tail == HWC_DEADLINE_DEPTH) {
+        hwc_deadline_release(&dl->frames[dl->tail % HWC_DEADLINE_DEPTH]);
+        dl->tail++;
+    }
+    hwc_deadline_frame_t* frame = &dl->frames[dl->head % HWC_DEADLINE_DEPTH];
+    frame->deadline = display_ctx->frame_deadline;
+    frame->set_time = display_ctx->frame_set_time;
+    frame->post_done = systemTime(CLOCK_MONOTONIC);
+    frame->acquire_fence = acquire_fence;
+    frame->release_fence = release_fence >= 0 ? dup(release_fence) : -1;
+    frame->shown = 0;
+    frame->late = -1;
+    dl->head++;
+
+    while (dl->head - dl->tail > 1) {
+        hwc_deadline_frame_t* prev = &dl->frames[dl->tail % HWC_DEADLINE_DEPTH];
+        hwc_deadline_frame_t* next = &dl->frames[(dl->tail + 1) % HWC_DEADLINE_DEPTH];
+        if (prev->release_fence >= 0) {
+            if (sync_wait(prev->release_fence, 0) < 0) break;
+            next->shown = fence_signal_time(prev->release_fence);
+            if (next->shown > display_ctx->flip_edge) {
+                display_ctx->flip_edge = next->shown;
+                display_ctx->flip_period = period;
             }
         }
+        if (next->shown) {
+            hwc_deadline_classify(dl, next, prev->shown ? prev : NULL, period, disp);
+            HWC_ATRACE_INT(disp == HWC_DISPLAY_PRIMARY ? "HWC_late" : "HWC_late_ext",
+                next->late >= 0);
+        }
+        //prev's shown time is kept, next is checked against it for drops.
+        hwc_deadline_release(prev);
+        dl->tail++;
     }
+}
 
-    LOG_FUNCTION_NAME_EXIT
-    return 0;
+static void hwc_deadline_clear(hwc_deadline_t* dl) {
+    while (dl->head != dl->tail) {
+        hwc_deadline_release(&dl->frames[dl->tail % HWC_DEADLINE_DEPTH]);
+        dl->tail++;
+    }
+}
+
+/*
+The release fence of a framebuffer target's last post signals when the
+display lets go of it. A stall is a frame whose buffer was let go only
+after SurfaceFlinger started composing it, at frame_start: the gpu had to
+wait for the display before rendering, which is what another framebuffer
+buffer would avoid. Going by the fence's own timestamp, the count doesn't
+depend on when or whether the HAL looked at the acquire fence.
+*/
+static void fb_release_track(display_context_t* display_ctx, buffer_handle_t handle, int release_fence,
+        nsecs_t frame_start) {
+    fb_release_t* slot = NULL;
+
+    for (int i = 0; i < HWC_FB_MAX_BUFFERS; i++) {
+        if (display_ctx->fb_releases[i].handle == handle) {
+            slot = &display_ctx->fb_releases[i];
+            break;
+        }
+    }
+    if (!slot) {
+        slot = &display_ctx->fb_releases[display_ctx->fb_release_next];
+        display_ctx->fb_release_next = (display_ctx->fb_release_next + 1) % HWC_FB_MAX_BUFFERS;
+    } else if (slot->fence >= 0 && (sync_wait(slot->fence, 0) < 0
+            || (frame_start && fence_signal_time(slot->fence) > frame_start))) {
+        display_ctx->fb_stalls++;
+        HWC_ATRACE_INT("HWC_fb_stall", display_ctx->fb_stalls);
+    }
+
+    if (slot->handle && slot->fence >= 0) close(slot->fence);
+    slot->handle = handle;
+    slot->fence = release_fence >= 0 ? dup(release_fence) : -1;
+}
+
+static void fb_release_clear(display_context_t* display_ctx) {
+    for (int i = 0; i < HWC_FB_MAX_BUFFERS; i++) {
+        fb_release_t* slot = &display_ctx->fb_releases[i];
+        if (slot->handle && slot->fence >= 0) close(slot->fence);
+        slot->handle = NULL;
+        slot->fence = -1;
+    }
+}
+
+/*
+Waiter thread report on an acquire fence fb_post found pending. A fence
+pending past the timeout holds up every post queued behind it in the
+driver; while one does, fb_post drops frames instead of queueing more.
+*/
+static void fb_fence_done(hwc_fence_watch_t const* watch) {
+    display_context_t* display_ctx = (display_context_t*)watch->data;
+
+    hwc_fence_stats_add(&display_ctx->fence_stats, &watch->fence);
+    if (watch->fence.status == HWC_FENCE_TIMEOUT) {
+        HWC_LOGEB("acquire fence pending for %lldms, gpu stuck",
+            (long long)ns2ms(watch->fence.wait_ns));
+        android_atomic_inc(&display_ctx->fences_stuck);
+    } else if (watch->expired) {
+        HWC_LOGEB("stuck acquire fence %s after %lldms",
+            watch->fence.status == HWC_FENCE_SIGNALED ? "signaled" : "failed",
+            (long long)ns2ms(watch->fence.wait_ns));
+        android_atomic_dec(&display_ctx->fences_stuck);
+    }
+}
+
+/*
+Look at the acquire fence of the buffer about to be posted without waiting
+for it, the driver does that. A pending one is handed to the waiter thread
+to be timed.
+*/
+static void fb_post_probe_fence(hwc_context_1_t* ctx, int disp, int fd) {
+    display_context_t* display_ctx = &ctx->display_ctxs[disp];
+
+    if (fd < 0) return;
+    display_ctx->fence_stats.waits++;
+    if (sync_wait(fd, 0) == 0) return;
+
+    HWC_ATRACE_INT("HWC_fence_wait", android_atomic_inc(&ctx->fence_wait_count) + 1);
+    int watched = dup(fd);
+    if (ctx->fence_thread_running && watched >= 0) {
+        hwc_fence_watch(&ctx->fence_waiter, watched, systemTime(CLOCK_MONOTONIC),
+            fb_fence_done, display_ctx);
+    } else if (watched >= 0) {
+        close(watched);
+    }
 }
 
 static int fb_post(hwc_context_1_t *pdev,
         hwc_display_contents_1_t* contents, int display_type) {
+    HWC_ATRACE_CALL();
+    hwc_backend_t* be = &pdev->backend;
+    uint32_t caps = be->ops->caps(be, display_type);
+    buffer_handle_t cursor = NULL;
+    uint32_t scan_bytes = 0;
     int err = 0;
     size_t i = 0;
 
-#ifdef ENABLE_CURSOR_LAYER
-    cursor_context_t * cursor_ctx = &(pdev->display_ctxs[display_type].cursor_ctx);
-    framebuffer_info_t* cbinfo = &(cursor_ctx->cb_info);
-    bool cursor_show = false;
-#endif
+    //nothing reaches a link that is being switched, keep the buffers moving.
+    if (display_type < MAX_SUPPORT_DISPLAYS && hwc_link_is_down(&pdev->display_ctxs[display_type])) {
+        display_context_t* display_ctx = &pdev->display_ctxs[display_type];
+        for (i = 0; i < contents->numHwLayers; i++) {
+            hwc_layer_1_t *layer = &(contents->hwLayers[i]);
+            if (layer->compositionType != HWC_FRAMEBUFFER_TARGET
+                && !(layer->compositionType == HWC_OVERLAY && (int)i == display_ctx->direct_layer)) {
+                continue;
+            }
+            layer->releaseFenceFd = layer->acquireFenceFd;
+            layer->acquireFenceFd = -1;
+        }
+        contents->retireFenceFd = -1;
+        display_ctx->frames_skipped++;
+        display_ctx->deadlines.dropped++;
+        display_ctx->link_drops++;
+        return 0;
+    }
+
+    int direct_layer = -1;
+    if (display_type < MAX_SUPPORT_DISPLAYS) {
+        direct_layer = pdev->display_ctxs[display_type].direct_layer;
+        if (direct_layer >= (int)contents->numHwLayers
+            || contents->hwLayers[direct_layer].compositionType != HWC_OVERLAY) {
+            direct_layer = -1;
+        }
+    }
 
     for (i = 0; i < contents->numHwLayers; i++) {
-#ifdef ENABLE_CURSOR_LAYER
         //deal cursor layer
-        if (contents->hwLayers[i].flags & HWC_IS_CURSOR_LAYER) {
+        if ((contents->hwLayers[i].flags & HWC_IS_CURSOR_LAYER)
+            && contents->hwLayers[i].compositionType == HWC_CURSOR_OVERLAY) {
             hwc_layer_1_t *layer = &(contents->hwLayers[i]);
-            if (private_handle_t::validate(layer->handle) < 0) break;
-            private_handle_t *hnd = (private_handle_t *)layer->handle;
-
-            HWC_LOGDB("This is a Sprite, hnd->stride is %d, hnd->height is %d", hnd->stride, hnd->height);
-            if (cbinfo->info.xres != (unsigned int)hnd->stride || cbinfo->info.yres != (unsigned int)hnd->height) {
-                HWC_LOGDB("disp: %d cursor need to redrew", display_type);
-                update_cursor_buffer_locked(cbinfo, hnd->stride, hnd->height);
-                cursor_ctx->cbuffer = mmap(NULL, hnd->size, PROT_READ|PROT_WRITE, MAP_SHARED, cbinfo->fd, 0);
-                if (cursor_ctx->cbuffer != MAP_FAILED) {
-                    memcpy(cursor_ctx->cbuffer, hnd->base, hnd->size);
-                    munmap(cursor_ctx->cbuffer, hnd->size);
-                    HWC_LOGDA("setCursor ok");
-                } else {
-                    HWC_LOGEA("buffer mmap fail");
-                }
+            hwc_buffer_info_t const* info = buffer_info(pdev, display_type, layer->handle);
+            if (!info) break;
+            //the cursor osd takes no fence: until the new image is drawn the old one stays.
+            if (layer->acquireFenceFd >= 0 && sync_wait(layer->acquireFenceFd, 0) < 0) {
+                caps &= ~HWC_BACKEND_CAP_CURSOR;
             }
-            cursor_show = true;
+
+            cursor = layer->handle;
+            scan_bytes += info->stride * info->height * 4;
         }
-#endif
 
-        //deal framebuffer target layer
-        if (contents->hwLayers[i].compositionType == HWC_FRAMEBUFFER_TARGET) {
+        //deal framebuffer target layer, or the layer scanned out in its place.
+        bool direct = (int)i == direct_layer;
+        if (contents->hwLayers[i].compositionType == HWC_FRAMEBUFFER_TARGET && direct_layer >= 0) {
+            //nothing was rendered into it this frame.
+            if (contents->hwLayers[i].acquireFenceFd >= 0) close(contents->hwLayers[i].acquireFenceFd);
+            contents->hwLayers[i].releaseFenceFd = -1;
+            continue;
+        }
+        if (direct || contents->hwLayers[i].compositionType == HWC_FRAMEBUFFER_TARGET) {
             hwc_layer_1_t *layer = &(contents->hwLayers[i]);
-            if (private_handle_t::validate(layer->handle) < 0) break;
+            hwc_buffer_info_t const* info = buffer_info(pdev, display_type, layer->handle);
+            if (!info) break;
 
             //deal with virtural display fence
             if (display_type == HWC_DISPLAY_VIRTUAL) {
@@ -627,8 +2465,49 @@ static int fb_post(hwc_context_1_t *pdev,
                 continue;
             }
 
-            get_display_info(pdev, display_type);
-            layer->releaseFenceFd = fb_post_with_fence_locked(fbinfo,layer->handle,layer->acquireFenceFd);
+            display_context_t* display_ctx = &pdev->display_ctxs[display_type];
+            if (android_atomic_acquire_load(&display_ctx->fences_stuck) > 0) {
+                //an earlier frame's gpu work is stuck and the driver would queue this one
+                //behind it, keep the frame on screen. The buffer goes back once it's done,
+                //its fence isn't watched: only fences of frames posted count.
+                HWC_LOGEB("disp %d: earlier acquire fence stuck, drop frame", display_type);
+                display_ctx->stuck_drops++;
+                display_ctx->frames_skipped++;
+                display_ctx->deadlines.dropped++;
+                layer->releaseFenceFd = layer->acquireFenceFd;
+                layer->acquireFenceFd = -1;
+                contents->retireFenceFd = -1;
+                continue;
+            }
+            bool afbc = (info->flags & HWC_BUFFER_AFBC) != 0;
+            if (afbc && !display_ctx->afbc_capable) {
+                //scanning it out uncompressed would show garbage, keep the last frame instead.
+                HWC_LOGEB("disp %d: osd can't decode afbc, drop frame", display_type);
+                display_ctx->afbc_rejected++;
+                display_ctx->frames_skipped++;
+                display_ctx->deadlines.dropped++;
+                layer->releaseFenceFd = layer->acquireFenceFd;
+                layer->acquireFenceFd = -1;
+                contents->retireFenceFd = -1;
+                continue;
+            }
+            if (afbc != display_ctx->afbc_enabled) osd_set_afbc(display_ctx, afbc);
+            if (!direct) display_ctx->fb_afbc = afbc;
+            scan_bytes += info->scan_bytes;
+            if (direct) display_ctx->direct_frames++;
+
+            fb_post_probe_fence(pdev, display_type, layer->acquireFenceFd);
+            //the backend takes the acquire fence, keep a copy to see when rendering finished.
+            int acquire_fence = display_ctx->frame_deadline && layer->acquireFenceFd >= 0
+                ? dup(layer->acquireFenceFd) : -1;
+            bool video = (android_atomic_acquire_load(&pdev->video_post_pending) & (1 << display_type)) != 0;
+            int video_fence = video && layer->acquireFenceFd >= 0 ? dup(layer->acquireFenceFd) : -1;
+            int ret;
+            {
+                HWC_ATRACE_NAME("backend_post");
+                ret = be->ops->post(be, display_type, layer->handle,
+                        layer->acquireFenceFd, &layer->releaseFenceFd);
+            }
 
             if (layer->releaseFenceFd >= 0) {
                 //layer->releaseFenceFd = releaseFence;
@@ -638,26 +2517,159 @@ static int fb_post(hwc_context_1_t *pdev,
                         layer->releaseFenceFd,
                         contents->retireFenceFd);
             } else {
-                HWC_LOGEB("No valid release_fence returned. %d ",layer->releaseFenceFd);
-                //-1 means no fence, less than -1 is some error
-                if (layer->releaseFenceFd < -1) err = layer->releaseFenceFd;
+                HWC_LOGEB("No valid release_fence returned. %d ",ret);
+                if (ret) err = ret;
                 contents->retireFenceFd = layer->releaseFenceFd = -1;
             }
+            if (ret) display_ctx->frames_skipped++;
+            else display_ctx->frames_posted++;
+            if (!direct) fb_release_track(display_ctx, layer->handle, layer->releaseFenceFd, pdev->prepare_time);
+            if (ret) {
+                if (acquire_fence >= 0) close(acquire_fence);
+                //the axis waits for a frame that makes it.
+                if (video_fence >= 0) close(video_fence);
+                display_ctx->deadlines.dropped++;
+            } else {
+                hwc_deadline_track(pdev, display_type, acquire_fence, layer->releaseFenceFd);
+                if (video) hwc_video_post(pdev, display_type, video_fence);
+            }
         }
     }
 
-#ifdef ENABLE_CURSOR_LAYER
     //finally we need to update cursor's blank status
-    if (cbinfo->fd > 0 && (cursor_show != cursor_ctx->show) ) {
-        cursor_ctx->show = cursor_show;
-        HWC_LOGVB("UPDATE FB1 status to %d ",cursor_show);
-        ioctl(cbinfo->fd, FBIOBLANK, !cursor_ctx->show);
-    }
-#endif
+    if (caps & HWC_BACKEND_CAP_CURSOR) be->ops->set_cursor(be, display_type, cursor);
 
+    if (display_type < MAX_SUPPORT_DISPLAYS) pdev->display_ctxs[display_type].scan_bytes = scan_bytes;
+    HWC_ATRACE_INT(display_type == HWC_DISPLAY_PRIMARY ? "HWC_scan_kb" : "HWC_scan_kb_ext",
+        scan_bytes / 1024);
     return err;
 }
 
+static void *hwc_fence_thread(void *data) {
+    hwc_context_1_t* ctx = (hwc_context_1_t*)data;
+
+    //times the fences and writes the video axis the moment a frame is ready.
+    hwc_thread_sched(ctx, HWC_THREAD_FENCE, "fence", HAL_PRIORITY_URGENT_DISPLAY);
+    hwc_fence_waiter_run(&ctx->fence_waiter);
+    return NULL;
+}
+
+static void *hwc_post_thread(void *data) {
+    post_worker_t* worker = (post_worker_t*)data;
+
+    //same as the SurfaceFlinger thread handing it the frames.
+    hwc_thread_sched(worker->ctx, HWC_THREAD_POST + worker->disp,
+        worker->disp == HWC_DISPLAY_PRIMARY ? "post" : "post_ext", HAL_PRIORITY_URGENT_DISPLAY);
+
+    pthread_mutex_lock(&worker->lock);
+    while (worker->running) {
+        if (!worker->pending) {
+            pthread_cond_wait(&worker->cond, &worker->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        nsecs_t post_start = systemTime(CLOCK_MONOTONIC);
+        int result = fb_post(worker->ctx, worker->contents, worker->disp);
+        nsecs_t post_ns = systemTime(CLOCK_MONOTONIC) - post_start;
+
+        pthread_mutex_lock(&worker->lock);
+        worker->result = result;
+        worker->post_ns = post_ns;
+        worker->pending = false;
+        pthread_cond_broadcast(&worker->cond);
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return NULL;
+}
+
+static int post_worker_start(hwc_context_1_t* ctx, int disp) {
+    post_worker_t* worker = &ctx->display_ctxs[disp].post_worker;
+
+    if (worker->running) return 0;
+
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->cond, NULL);
+    worker->ctx = ctx;
+    worker->disp = disp;
+    worker->pending = false;
+    worker->running = true;
+    int ret = pthread_create(&worker->thread, NULL, hwc_post_thread, worker);
+    if (ret) {
+        HWC_LOGEB("failed to start post thread for display %d: %s", disp, strerror(ret));
+        worker->running = false;
+        pthread_cond_destroy(&worker->cond);
+        pthread_mutex_destroy(&worker->lock);
+        return -ret;
+    }
+    return 0;
+}
+
+static void post_worker_stop(post_worker_t* worker) {
+    if (!worker->running) return;
+
+    pthread_mutex_lock(&worker->lock);
+    worker->running = false;
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+    pthread_join(worker->thread, NULL);
+
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->lock);
+}
+
+static void post_worker_submit(post_worker_t* worker, hwc_display_contents_1_t* contents) {
+    pthread_mutex_lock(&worker->lock);
+    worker->contents = contents;
+    worker->pending = true;
+    pthread_cond_broadcast(&worker->cond);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+static int post_worker_wait(post_worker_t* worker, nsecs_t* post_ns) {
+    pthread_mutex_lock(&worker->lock);
+    while (worker->pending) {
+        pthread_cond_wait(&worker->cond, &worker->lock);
+    }
+    int result = worker->result;
+    *post_ns = worker->post_ns;
+    pthread_mutex_unlock(&worker->lock);
+    return result;
+}
+
+//snapshot of the frame counters for the telemetry page, all posts are done.
+static void hwc_telemetry_frames(hwc_context_1_t* ctx, nsecs_t set_time) {
+    hwc_telemetry_frames_t frames;
+
+    memset(&frames, 0, sizeof(frames));
+    frames.count = ctx->frame_count;
+    frames.set_time = set_time;
+    frames.prepare_ns = ctx->prepare_ns;
+    frames.fence_waits = android_atomic_acquire_load(&ctx->fence_wait_count);
+    for (int i = 0; i < MAX_SUPPORT_DISPLAYS && i < HWC_TELEMETRY_DISPLAYS; i++) {
+        display_context_t* display_ctx = &ctx->display_ctxs[i];
+        hwc_telemetry_display_t* d = &frames.displays[i];
+        display_state_t state;
+
+        display_state_read(display_ctx, &state);
+        d->connected = state.connected;
+        d->xres = state.xres;
+        d->yres = state.yres;
+        d->out_xres = state.out_xres;
+        d->out_yres = state.out_yres;
+        d->vsync_period = state.vsync_period;
+        d->frames_posted = display_ctx->frames_posted;
+        d->frames_skipped = display_ctx->frames_skipped;
+        d->scan_bytes = display_ctx->scan_bytes;
+        d->fb_stalls = display_ctx->fb_stalls;
+        d->fence_timeouts = display_ctx->fence_stats.timeouts;
+        d->fence_wait_max_ns = display_ctx->fence_stats.max_ns;
+        memcpy(d->fence_hist, display_ctx->fence_stats.hist, sizeof(d->fence_hist));
+        frames.fence_timeouts += display_ctx->fence_stats.timeouts;
+    }
+    hwc_telemetry_publish_frames(&ctx->telemetry, &frames);
+}
 
 static int hwc_set(struct hwc_composer_device_1 *dev,
         size_t numDisplays, hwc_display_contents_1_t** displays) {
@@ -665,40 +2677,100 @@ static int hwc_set(struct hwc_composer_device_1 *dev,
     size_t i = 0, j = 0;
     hwc_context_1_t *pdev =  (hwc_context_1_t *)dev;
     hwc_display_contents_1_t *display_content = NULL;
+    bool axis_applied[HWC_NUM_DISPLAY_TYPES] = {false};
+    hwc_rect_t axis[HWC_NUM_DISPLAY_TYPES];
 
     if (!numDisplays || !displays) return 0;
 
     LOG_FUNCTION_NAME
-    //TODO: need improve the way to set video axis.
-#if WITH_LIBPLAYER_MODULE
-    for (i = 0; i < numDisplays; i++) {
-        CHK_SKIP_DISPLAY_FB0();
+    HWC_ATRACE_CALL();
+    nsecs_t set_time = systemTime(CLOCK_MONOTONIC);
+    if (hwc_trace_enabled(&pdev->trace)) {
+        hwc_trace_record(&pdev->trace, HWC_TRACE_CALL_SET, numDisplays, displays);
+    }
+
+    for (i = 0; i < numDisplays && i < MAX_SUPPORT_DISPLAYS; i++) {
+        CHK_SKIP_DISPLAY_FB0(i);
+        if (displays[i] && hwc_sideband_compose(pdev, i, displays[i], &axis[i])) {
+            axis_applied[i] = true;
+        }
+    }
+
+    bool video_changed = chk_video_sysfs_changed(pdev);
+    for (i = 0; i < numDisplays && i < HWC_NUM_DISPLAY_TYPES; i++) {
+        CHK_SKIP_DISPLAY_FB0(i);
         display_content = displays[i];
-        if (display_content) {
-            for (j = 0; j < display_content->numHwLayers; j++) {
-                hwc_layer_1_t* l = &display_content->hwLayers[j];
-                if (l->compositionType == HWC_OVERLAY) {
-                    hwc_overlay_compose(pdev, l);
-                }
+        if (!display_content) continue;
+
+        //the virtual display has no state of its own.
+        uint32_t version = 0;
+        if (i < MAX_SUPPORT_DISPLAYS) {
+            display_state_t state;
+            display_state_read(&pdev->display_ctxs[i], &state);
+            version = state.version;
+        }
+        for (j = 0; j < display_content->numHwLayers; j++) {
+            hwc_layer_1_t* l = &display_content->hwLayers[j];
+            if (l->compositionType == HWC_OVERLAY
+                && hwc_overlay_compose(pdev, i, l, version, video_changed)) {
+                axis_applied[i] = true;
+                axis[i] = l->displayFrame;
             }
         }
     }
+    hwc_release_video_planes(pdev);
 
-#endif
+    if (pdev->bg_color != android_atomic_acquire_load(&pdev->bg_pending)) {
+        android_atomic_release_store(pdev->bg_color, &pdev->bg_pending);
+        hwc_latch(pdev, HWC_LATCH_BACKGROUND);
+    }
+
+    for (i = 0; i < numDisplays && i < MAX_SUPPORT_DISPLAYS; i++) {
+        pdev->display_ctxs[i].frame_deadline = hwc_frame_deadline(pdev, i);
+        pdev->display_ctxs[i].frame_set_time = set_time;
+    }
+
+    //external display posts on its own thread while this one posts primary.
+    bool async[HWC_NUM_DISPLAY_TYPES] = {false};
+    if (numDisplays > HWC_DISPLAY_EXTERNAL && displays[HWC_DISPLAY_PRIMARY]
+        && displays[HWC_DISPLAY_EXTERNAL]
+        && pdev->display_ctxs[HWC_DISPLAY_EXTERNAL].post_worker.running) {
+        post_worker_submit(&pdev->display_ctxs[HWC_DISPLAY_EXTERNAL].post_worker,
+                displays[HWC_DISPLAY_EXTERNAL]);
+        async[HWC_DISPLAY_EXTERNAL] = true;
+    }
 
     for (i=0;i<numDisplays;i++) {
-        CHK_SKIP_DISPLAY_FB0();
+        CHK_SKIP_DISPLAY_FB0(i);
         display_content = displays[i];
-        if (display_content) {
+        if (display_content && !async[i]) {
             if (i <= HWC_DISPLAY_VIRTUAL) {
                  //physic display
-                 err = fb_post(pdev,display_content,i);
+                 nsecs_t post_start = systemTime(CLOCK_MONOTONIC);
+                 int ret = fb_post(pdev,display_content,i);
+                 if (ret) err = ret;
+                 hwc_frame_log_record(pdev, i, display_content, ret, set_time,
+                        systemTime(CLOCK_MONOTONIC) - post_start, axis_applied[i], &axis[i]);
             } else {
                  HWC_LOGEB("display %d is not supported",i);
             }
         }
     }
 
+    for (i = 0; i < HWC_NUM_DISPLAY_TYPES; i++) {
+        if (!async[i]) continue;
+        nsecs_t post_ns = 0;
+        int ret = post_worker_wait(&pdev->display_ctxs[i].post_worker, &post_ns);
+        if (ret) err = ret;
+        hwc_frame_log_record(pdev, i, displays[i], ret, set_time, post_ns, axis_applied[i], &axis[i]);
+    }
+    //no frame of the display made it this time, don't hold its video planes back.
+    for (i = 0; i < MAX_SUPPORT_DISPLAYS; i++) {
+        if (android_atomic_acquire_load(&pdev->video_post_pending) & (1 << i)) hwc_video_post(pdev, i, -1);
+    }
+    pdev->frame_count++;
+    if (hwc_telemetry_enabled(&pdev->telemetry)) hwc_telemetry_frames(pdev, set_time);
+
     LOG_FUNCTION_NAME_EXIT
     return err;
 }
@@ -710,25 +2782,39 @@ static int hwc_close(hw_device_t *device) {
 
     pthread_kill(dev->vsync_thread, SIGTERM);
     pthread_join(dev->vsync_thread, NULL);
+    if (dev->fence_thread_running) {
+        hwc_fence_waiter_stop(&dev->fence_waiter);
+        pthread_join(dev->fence_thread, NULL);
+        hwc_fence_waiter_destroy(&dev->fence_waiter);
+    }
+
+    for (int i = 0; i < MAX_SUPPORT_DISPLAYS; i++) {
+        post_worker_stop(&dev->display_ctxs[i].post_worker);
+        fb_release_clear(&dev->display_ctxs[i]);
+        hwc_deadline_clear(&dev->display_ctxs[i].deadlines);
+    }
 
     uninit_display(dev,HWC_DISPLAY_PRIMARY);
     uninit_display(dev,HWC_DISPLAY_EXTERNAL);
 
+    hwc_trace_close(&dev->trace);
+    hwc_telemetry_close(&dev->telemetry);
+    dev->backend.ops->close(&dev->backend);
+    pthread_mutex_destroy(&dev->video_lock);
+
     if (dev) free(dev);
 
     LOG_FUNCTION_NAME_EXIT
     return 0;
 }
 
-//#define USE_HW_VSYNC
-#ifdef USE_HW_VSYNC
 /*
-Still have bugs, don't use it.
+hwc_policy::hw_vsync. Still have bugs, don't use it.
 */
-int wait_next_vsync(struct hwc_context_1_t* ctx, nsecs_t* vsync_timestamp) {
+static int wait_next_vsync_hw(struct hwc_context_1_t* ctx, nsecs_t* vsync_timestamp) {
     static nsecs_t previewTime = 0;
     nsecs_t vsyncDiff=0;
-    const nsecs_t period = ctx->vsync_period;
+    const nsecs_t period = display_vsync_period(ctx, HWC_DISPLAY_PRIMARY);
     //we will delay hw vsync if missing one vsync interrupt isr.
     int ret = 0;
 
@@ -760,31 +2846,35 @@ int wait_next_vsync(struct hwc_context_1_t* ctx, nsecs_t* vsync_timestamp) {
     return ret;
 }
 
-#else
-
 //software
-int wait_next_vsync(struct hwc_context_1_t* ctx, nsecs_t* vsync_timestamp) {
-    static nsecs_t vsync_time = 0;
-    static nsecs_t old_vsync_period = 0;
-    nsecs_t sleep;
+static int wait_next_vsync_sw(struct hwc_context_1_t* ctx, nsecs_t* vsync_timestamp) {
+    nsecs_t& vsync_time = ctx->vsync_time;
+    nsecs_t& old_vsync_period = ctx->vsync_anchor_period;
     nsecs_t now = systemTime(CLOCK_MONOTONIC);
+    const nsecs_t period = display_vsync_period(ctx, HWC_DISPLAY_PRIMARY);
+
+    //the output was just switched, its first frame starts about now.
+    if (android_atomic_acquire_cas(1, 0, &ctx->vsync_reanchor) == 0) {
+        vsync_time = now;
+        old_vsync_period = period;
+    }
 
     //cal the last vsync time with old period
-    if (ctx->vsync_period != old_vsync_period) {
+    if (period != old_vsync_period) {
         if (old_vsync_period > 0) {
             vsync_time = vsync_time +
                     ((now - vsync_time) / old_vsync_period) * old_vsync_period;
         }
-        old_vsync_period = ctx->vsync_period;
+        old_vsync_period = period;
     }
 
     //set to next vsync time
-    vsync_time +=ctx->vsync_period;
+    vsync_time += period;
 
     // we missed, find where the next vsync should be
     if (vsync_time - now < 0) {
-        vsync_time = now + (ctx->vsync_period -
-                 ((now - vsync_time) % ctx->vsync_period));
+        vsync_time = now + (period -
+                 ((now - vsync_time) % period));
     }
 
     struct timespec spec;
@@ -799,24 +2889,133 @@ int wait_next_vsync(struct hwc_context_1_t* ctx, nsecs_t* vsync_timestamp) {
 
     return err;
 }
-#endif
+
+int wait_next_vsync(struct hwc_context_1_t* ctx, nsecs_t* vsync_timestamp) {
+    if (hwc_policy::hw_vsync) return wait_next_vsync_hw(ctx, vsync_timestamp);
+    return wait_next_vsync_sw(ctx, vsync_timestamp);
+}
+
+static void hwc_cursor_apply(hwc_context_1_t* ctx, int disp) {
+    cursor_context_t * cursor_ctx = &(ctx->display_ctxs[disp].cursor_ctx);
+    hwc_backend_t* be = &ctx->backend;
+
+    int32_t pos = android_atomic_acquire_load(&cursor_ctx->pending_pos);
+    HWC_LOGDB("disp %d cursor x_pos=%d, y_pos=%d", disp, CURSOR_POS_X(pos), CURSOR_POS_Y(pos));
+    if (be->ops->set_cursor_pos(be, disp, CURSOR_POS_X(pos), CURSOR_POS_Y(pos)) == 0) {
+        cursor_ctx->pos_applied++;
+    }
+}
+
+static void hwc_background_apply(hwc_context_1_t* ctx) {
+    int32_t color = android_atomic_acquire_load(&ctx->bg_pending);
+    if (color == ctx->bg_applied) return;
+
+    //bt.709 limited range, the vpp blends in yuv.
+    int r = (color >> 16) & 0xff, g = (color >> 8) & 0xff, b = color & 0xff;
+    int y = 16 + ((47 * r + 157 * g + 16 * b) >> 8);
+    int u = 128 + ((-26 * r - 87 * g + 112 * b) >> 8);
+    int v = 128 + ((112 * r - 102 * g - 10 * b) >> 8);
+
+    char val[16];
+    snprintf(val, sizeof(val), "0x%02x%02x%02x", y, u, v);
+    if (sysfs_write_str(SYSFS_VIDEO_TEST_SCREEN, val) == 0) ctx->bg_applied = color;
+}
+
+//runs on the vsync thread right after the vsync edge.
+static void hwc_apply_latched(hwc_context_1_t* ctx) {
+    int32_t pending = android_atomic_and(0, &ctx->latch_pending);
+    if (!pending) return;
+
+    HWC_ATRACE_CALL();
+    for (int i = 0; hwc_policy::cursor_layer && i < MAX_SUPPORT_DISPLAYS; i++) {
+        if (pending & HWC_LATCH_CURSOR(i)) hwc_cursor_apply(ctx, i);
+    }
+    if (pending & HWC_LATCH_BACKGROUND) hwc_background_apply(ctx);
+}
+
+/*
+Vsync interval stats for the telemetry page. An interval more than half a
+period late counts the vsyncs it skipped instead of adding to the jitter.
+The jitter is taken between actual wakeups, the software timer's
+timestamps are exact multiples of the period. The wakeup lateness is what
+the thread's scheduling policy costs us.
+*/
+static void hwc_vsync_stats(hwc_context_1_t* ctx, nsecs_t timestamp, nsecs_t woke) {
+    static const int64_t wake_bounds_us[] = HWC_TELEMETRY_WAKE_BOUNDS_US;
+    hwc_telemetry_vsync_t* stats = &ctx->vsync_stats;
+    nsecs_t period = display_vsync_period(ctx, HWC_DISPLAY_PRIMARY);
+
+    nsecs_t late = woke > timestamp ? woke - timestamp : 0;
+    int bucket = 0;
+    while (bucket < HWC_TELEMETRY_WAKE_BUCKETS - 1 && late >= us2ns(wake_bounds_us[bucket])) bucket++;
+    stats->wake_hist[bucket]++;
+    if (late > stats->wake_max_ns) stats->wake_max_ns = late;
+
+    //intervals only between vsyncs SurfaceFlinger asked for back to back, a wakeup
+    //after the thread slept or for a latch while vsync is off has no predecessor.
+    bool enabled = android_atomic_acquire_load(&ctx->vsync_enable) != 0;
+    if (enabled && stats->timestamp && period > 0 && timestamp > stats->timestamp) {
+        nsecs_t interval = timestamp - stats->timestamp;
+        nsecs_t woke_interval = woke - ctx->vsync_woke;
+        if (interval > period + period / 2) {
+            stats->missed += (interval + period / 2) / period - 1;
+        } else {
+            stats->jitter_ns = woke_interval > period ? woke_interval - period : period - woke_interval;
+            if (stats->jitter_ns > stats->jitter_max_ns) stats->jitter_max_ns = stats->jitter_ns;
+        }
+    }
+    stats->count++;
+    stats->timestamp = enabled ? timestamp : 0;
+    ctx->vsync_woke = enabled ? woke : 0;
+    stats->overlay_updates = ctx->overlay_axis_count;
+    hwc_telemetry_publish_vsync(&ctx->telemetry, stats);
+}
 
 static void *hwc_vsync_thread(void *data) {
     struct hwc_context_1_t* ctx = (struct hwc_context_1_t*)data;
     nsecs_t timestamp;
 
-    setpriority(PRIO_PROCESS, 0, HAL_PRIORITY_URGENT_DISPLAY-1);
-    sleep(2);
+    hwc_thread_sched(ctx, HWC_THREAD_VSYNC, "vsync", HAL_PRIORITY_URGENT_DISPLAY-1);
 
     while (true) {
-        pthread_mutex_lock(&hwc_mutex);
-        while (ctx->vsync_enable == false) {
-            pthread_cond_wait(&hwc_cond, &hwc_mutex);
+        //only take the lock to sleep, not on every vsync.
+        if (!android_atomic_acquire_load(&ctx->vsync_enable)
+            && !android_atomic_acquire_load(&ctx->latch_pending)) {
+            //the idle gap is no missed vsync.
+            ctx->vsync_stats.timestamp = 0;
+            ctx->vsync_woke = 0;
+            pthread_mutex_lock(&hwc_mutex);
+            while (!android_atomic_acquire_load(&ctx->vsync_enable)
+                && !android_atomic_acquire_load(&ctx->latch_pending)) {
+                pthread_cond_wait(&hwc_cond, &hwc_mutex);
+            }
+            pthread_mutex_unlock(&hwc_mutex);
         }
-        pthread_mutex_unlock(&hwc_mutex);
 
-        if (wait_next_vsync(ctx,&timestamp) == 0) {
-            if (ctx->procs) ctx->procs->vsync(ctx->procs, 0, timestamp);
+        hwc_backend_t* be = &ctx->backend;
+        int ret = -ENOSYS;
+        if (be->ops->caps(be, HWC_DISPLAY_PRIMARY) & HWC_BACKEND_CAP_VBLANK) {
+            ret = be->ops->wait_vblank(be, HWC_DISPLAY_PRIMARY, &timestamp);
+        }
+        //nothing scanned out yet or no vblank events, keep the software timer.
+        if (ret) ret = wait_next_vsync(ctx, &timestamp);
+
+        if (ret == 0) {
+            nsecs_t woke = systemTime(CLOCK_MONOTONIC);
+            int32_t seq = ctx->vsync_edge_seq;
+            android_atomic_release_store(seq + 1, &ctx->vsync_edge_seq);
+            android_memory_barrier();
+            ctx->vsync_edge = timestamp;
+            android_atomic_release_store(seq + 2, &ctx->vsync_edge_seq);
+            hwc_apply_latched(ctx);
+            hwc_vsync_stats(ctx, timestamp, woke);
+            HWC_ATRACE_INT("HWC_VSYNC_0", ctx->vsync_toggle ^= 1);
+            HWC_ATRACE_INT64("HWC_vsync_timestamp", timestamp);
+            if (ctx->procs && android_atomic_acquire_load(&ctx->vsync_enable)) {
+                HWC_ATRACE_NAME("vsync_callback");
+                ctx->procs->vsync(ctx->procs, 0, timestamp);
+                if (!ctx->first_vsync_time) ctx->first_vsync_time = systemTime(CLOCK_MONOTONIC);
+            }
         }
     }
 
@@ -862,18 +3061,115 @@ static bool chk_external_conect() {
 #endif
 }
 
+static int post_worker_start(hwc_context_1_t* ctx, int disp);
+
+static void hwc_external_connect(hwc_context_1_t* ctx) {
+    if (display_connected(ctx, HWC_DISPLAY_EXTERNAL)) return;
+
+    init_display(ctx, HWC_DISPLAY_EXTERNAL);
+    pthread_mutex_lock(&hwc_mutex);
+    chk_display_mode(ctx, HWC_DISPLAY_EXTERNAL);
+    pthread_mutex_unlock(&hwc_mutex);
+    post_worker_start(ctx, HWC_DISPLAY_EXTERNAL);
+
+    HWC_LOGIA("external display connected");
+    if (ctx->procs) ctx->procs->hotplug(ctx->procs, HWC_DISPLAY_EXTERNAL, 1);
+}
+
+static void hwc_external_disconnect(hwc_context_1_t* ctx) {
+    if (!display_connected(ctx, HWC_DISPLAY_EXTERNAL)) return;
+
+    uninit_display(ctx, HWC_DISPLAY_EXTERNAL);
+
+    HWC_LOGIA("external display disconnected");
+    if (ctx->procs) ctx->procs->hotplug(ctx->procs, HWC_DISPLAY_EXTERNAL, 0);
+}
+
+static void hwc_link_down(hwc_context_1_t* ctx, int disp) {
+    display_context_t* display_ctx = &ctx->display_ctxs[disp];
+
+    display_ctx->link_down_time = systemTime(CLOCK_MONOTONIC);
+    android_atomic_release_store(1, &display_ctx->link_down);
+    HWC_LOGDB("display %d: link down, hold posts", disp);
+}
+
+/*
+The link is back: pick up the new mode and start the vsync phase over.
+SurfaceFlinger only has to rebuild the display if the ui size changed;
+for a new refresh rate a redraw is enough, it follows the vsync timestamps.
+*/
+static void hwc_link_up(hwc_context_1_t* ctx, int disp) {
+    display_context_t* display_ctx = &ctx->display_ctxs[disp];
+    display_state_t before, after;
+
+    display_state_read(display_ctx, &before);
+    pthread_mutex_lock(&hwc_mutex);
+    chk_display_mode(ctx, disp);
+    pthread_mutex_unlock(&hwc_mutex);
+    display_state_read(display_ctx, &after);
+
+    bool was_down = android_atomic_acquire_load(&display_ctx->link_down);
+    android_atomic_release_store(0, &display_ctx->link_down);
+    if (disp == HWC_DISPLAY_PRIMARY && (was_down || after.vsync_period != before.vsync_period)) {
+        android_atomic_release_store(1, &ctx->vsync_reanchor);
+    }
+
+    HWC_LOGDB("display %d: link up, %ux%u period %d", disp, after.xres, after.yres, after.vsync_period);
+    if (after.xres != before.xres || after.yres != before.yres) {
+        ctx->procs->hotplug(ctx->procs, disp, 1);
+    } else if (was_down || after.vsync_period != before.vsync_period) {
+        ctx->procs->invalidate(ctx->procs);
+    }
+}
+
+//hdmi_audio and hdmi_power switch events, called on the hotplug thread.
+static void hwc_hdmi_event(hwc_context_1_t* ctx, const char* name, const char* state) {
+    bool up = !strcmp(state, "1");
+
+    if (!up && strcmp(state, "0")) return;
+    if (strcmp(name, "hdmi_audio") && strcmp(name, "hdmi_power")) return;
+
+    //with an external display hdmi is that, hdmi_audio tells whether a sink is there.
+    const int disp = hwc_policy::external_display ? HWC_DISPLAY_EXTERNAL : HWC_DISPLAY_PRIMARY;
+    if (hwc_policy::external_display) {
+        if (!strcmp(name, "hdmi_audio")) {
+            if (!up) {
+                hwc_external_disconnect(ctx);
+                return;
+            }
+            if (!display_connected(ctx, disp)) {
+                hwc_external_connect(ctx);
+                return;
+            }
+        }
+        if (!display_connected(ctx, disp)) return;
+    }
+
+    if (up) hwc_link_up(ctx, disp);
+    else hwc_link_down(ctx, disp);
+}
+
 static void *hwc_hotplug_thread(void *data) {
     struct hwc_context_1_t* ctx = (struct hwc_context_1_t*)data;
-    bool fpsChanged = false, sizeChanged = false;
+    hwc_thread_sched(ctx, HWC_THREAD_HOTPLUG, "hotplug", HWC_SCHED_NICE_KEEP);
     //use uevent instead of usleep, because it has some delay
     hwc_uevent_data_t u_data;
     memset(&u_data, 0, sizeof(hwc_uevent_data_t));
     int fd = uevent_init();
+    bool external_probed = false;
+
+    //nobody to tell about hotplugs until SurfaceFlinger registers.
+    pthread_mutex_lock(&hwc_mutex);
+    while (!ctx->procs) pthread_cond_wait(&hwc_cond, &hwc_mutex);
+    pthread_mutex_unlock(&hwc_mutex);
 
     while (fd > 0) {
         if (ctx->procs) {
-            fpsChanged = false;
-            sizeChanged = false;
+            //external may already be plugged at boot, nothing will tell us.
+            if (hwc_policy::external_display && !external_probed) {
+                external_probed = true;
+                if (chk_external_conect()) hwc_external_connect(ctx);
+            }
             u_data.len= uevent_next_event(u_data.buf, sizeof(u_data.buf) - 1);
             if (u_data.len <= 0)
                 continue;
@@ -890,22 +3186,10 @@ static void *hwc_hotplug_thread(void *data) {
             }
             HWC_LOGEB("Received uevent message: %s", printBuf);
 #endif
-            if (isMatch(&u_data, HDMI_UEVENT)) {
+            if (isMatch(&u_data, HDMI_UEVENT) || isMatch(&u_data, HDMI_POWER_UEVENT)) {
+                HWC_ATRACE_NAME("hdmi_uevent");
                 //HWC_LOGEB("HDMI switch_state: %s switch_name: %s\n", u_data.state, u_data.name);
-                if ((!strcmp(u_data.name, "hdmi_audio")) &&
-                    (!strcmp(u_data.state, "1"))) {
-                    // update vsync period if neccessry
-                    nsecs_t newperiod = chk_output_mode(ctx->mode);
-                    // check if vsync period is changed
-                    if (newperiod > 0 && newperiod != ctx->vsync_period) {
-                        ctx->vsync_period = newperiod;
-                        fpsChanged = true;
-                    }
-                    sizeChanged = chk_vinfo(ctx, HWC_DISPLAY_PRIMARY);
-                    if (fpsChanged || sizeChanged) {
-                        ctx->procs->hotplug(ctx->procs, HWC_DISPLAY_PRIMARY, 1);
-                    }
-                }
+                hwc_hdmi_event(ctx, u_data.name, u_data.state);
             }
         }
     }
@@ -918,7 +3202,11 @@ static void hwc_registerProcs(hwc_composer_device_1 *dev,
             hwc_procs_t const* procs) {
     struct hwc_context_1_t* ctx = (struct hwc_context_1_t*)dev;
 
-    if (ctx) ctx->procs = procs;
+    if (!ctx) return;
+    pthread_mutex_lock(&hwc_mutex);
+    ctx->procs = procs;
+    pthread_cond_broadcast(&hwc_cond);
+    pthread_mutex_unlock(&hwc_mutex);
 }
 
 static int hwc_getDisplayConfigs(hwc_composer_device_1_t *dev,
@@ -936,8 +3224,9 @@ static int hwc_getDisplayConfigs(hwc_composer_device_1_t *dev,
         *numConfigs = 1;
         return 0;
     } else if (disp == HWC_DISPLAY_EXTERNAL) {
-        HWC_LOGEB("hwc_getDisplayConfigs:connect =  %d",display_ctx->connected);
-        if (!display_ctx->connected) return -EINVAL;
+        bool connected = display_connected(ctx, disp);
+        HWC_LOGEB("hwc_getDisplayConfigs:connect =  %d",connected);
+        if (!connected) return -EINVAL;
 
         config[0] = 0;
         *numConfigs = 1;
@@ -954,24 +3243,25 @@ static int hwc_getDisplayAttributes(hwc_composer_device_1_t *dev,
 
     LOG_FUNCTION_NAME
 
-    get_display_info(ctx,disp);
+    display_state_t state;
+    display_state_read(&ctx->display_ctxs[disp], &state);
 
     for (int i = 0; attributes[i] != HWC_DISPLAY_NO_ATTRIBUTE; i++) {
         switch (attributes[i]) {
             case HWC_DISPLAY_VSYNC_PERIOD:
-                values[i] = ctx->vsync_period;
+                values[i] = state.vsync_period;
             break;
             case HWC_DISPLAY_WIDTH:
-                values[i] = fbinfo->info.xres;
+                values[i] = state.xres;
             break;
             case HWC_DISPLAY_HEIGHT:
-                values[i] = fbinfo->info.yres;
+                values[i] = state.yres;
             break;
             case HWC_DISPLAY_DPI_X:
-                values[i] = fbinfo->xdpi*1000;
+                values[i] = state.xdpi*1000;
             break;
             case HWC_DISPLAY_DPI_Y:
-                values[i] = fbinfo->ydpi*1000;
+                values[i] = state.ydpi*1000;
             break;
             default:
                 HWC_LOGEB("unknown display attribute %u", attributes[i]);
@@ -1004,28 +3294,21 @@ static int hwc_setCursorPositionAsync(struct hwc_composer_device_1 *dev, int dis
     int x_pos, int y_pos) {
     LOG_FUNCTION_NAME
 
-#ifdef ENABLE_CURSOR_LAYER
-    int err = 0, i = 0;
-    struct fb_cursor cinfo;
     struct hwc_context_1_t* ctx = (struct hwc_context_1_t*)dev;
+    if (!hwc_policy::cursor_layer) return 0;
+    if (disp < 0 || disp >= MAX_SUPPORT_DISPLAYS) return -EINVAL;
+
     cursor_context_t * cursor_ctx = &(ctx->display_ctxs[disp].cursor_ctx);
     framebuffer_info_t* cbinfo = &(cursor_ctx->cb_info);
 
     if (cbinfo->fd < 0) {
         HWC_LOGEB("hwc_setCursorPositionAsync fd=%d", cbinfo->fd );
     }else {
-        cinfo.hot.x = x_pos;
-        cinfo.hot.y = y_pos;
-        if (disp == HWC_DISPLAY_PRIMARY) {
-            HWC_LOGDB("hwc_setCursorPositionAsync x_pos=%d, y_pos=%d", cinfo.hot.x, cinfo.hot.y);
-            ioctl(cbinfo->fd, FBIO_CURSOR, &cinfo);
-        } else if(disp == HWC_DISPLAY_EXTERNAL) {
-            //TODO:
-            HWC_LOGDA("hwc_setCursorPositionAsync external display need show cursor too! ");
-            //ioctl(cbinfo->fd, FBIO_CURSOR, &cinfo);
-        }
+        //latest position wins, the vsync thread applies it once per vsync.
+        android_atomic_release_store(CURSOR_POS_PACK(x_pos, y_pos), &cursor_ctx->pending_pos);
+        android_atomic_inc(&cursor_ctx->pos_requests);
+        hwc_latch(ctx, HWC_LATCH_CURSOR(disp));
     }
-#endif
 
     LOG_FUNCTION_NAME_EXIT
     return 0;
@@ -1041,6 +3324,12 @@ static int hwc_device_open(const struct hw_module_t* module, const char* name,
     struct hwc_context_1_t *dev;
     dev = (struct hwc_context_1_t *)malloc(sizeof(*dev));
     memset(dev, 0, sizeof(*dev));
+    dev->open_time = systemTime(CLOCK_MONOTONIC);
+    for (int i = 0; i < MAX_SUPPORT_DISPLAYS; i++) {
+        dev->display_ctxs[i].fb_info.fd = -1;
+        dev->display_ctxs[i].direct_layer = -1;
+        dev->display_ctxs[i].cursor_ctx.cb_info.fd = -1;
+    }
 
     if (hw_get_module(GRALLOC_HARDWARE_MODULE_ID,
         (const struct hw_module_t **)&dev->gralloc_module)) {
@@ -1049,12 +3338,58 @@ static int hwc_device_open(const struct hw_module_t* module, const char* name,
         goto err_get_module;
     }
 
+#ifdef HWC_DRM_BACKEND
+    {
+        char backend[PROPERTY_VALUE_MAX];
+        property_get(HWC_PROP_BACKEND, backend, "fbdev");
+        if (!strcmp(backend, "drm") && drm_backend_open(&dev->backend) != 0) {
+            HWC_LOGEA("drm backend not available, fall back to fbdev");
+        }
+    }
+#endif
+    if (!dev->backend.ops) {
+        dev->backend.ops = &fbdev_backend_ops;
+        dev->backend.priv = dev;
+    }
+
     //init primiary display
     //default is alwasy false,will check it in hot plug.
     init_display(dev,HWC_DISPLAY_PRIMARY);
 
     // willchanged to use hw vsync.
-    dev->vsync_period = chk_output_mode(dev->mode);
+    pthread_mutex_lock(&hwc_mutex);
+    chk_display_mode(dev, HWC_DISPLAY_PRIMARY);
+    pthread_mutex_unlock(&hwc_mutex);
+
+    pthread_mutex_init(&dev->video_lock, NULL);
+    for (int i = 0; i < MAX_SUPPORT_DISPLAYS; i++) dev->display_ctxs[i].video_fence = -1;
+    //the vpp comes up black, nothing to write until a layer asks for a color.
+    dev->bg_applied = HWC_BACKGROUND_BLACK;
+    //the pip layer only exists on vpps that have it, probe once.
+    dev->num_video_planes = access(SYSFS_VIDEO_AXIS_PIP, W_OK) ? 1 : 2;
+    dev->dualdisplay4 = chk_bool_prop("ro.vout.dualdisplay4");
+    {
+        char threshold[PROPERTY_VALUE_MAX];
+        property_get(HWC_PROP_DDR_THRESHOLD, threshold, "0");
+        int mbps = atoi(threshold);
+        if (mbps < 0) HWC_LOGEB("%s=%s ignored, no threshold", HWC_PROP_DDR_THRESHOLD, threshold);
+        dev->ddr_threshold = mbps > 0 ? (uint64_t)mbps << 20 : 0;
+    }
+    {
+        char timeout[PROPERTY_VALUE_MAX];
+        if (property_get(HWC_PROP_FENCE_TIMEOUT, timeout, NULL) > 0) {
+            dev->fence_timeout_ms = atoi(timeout);
+        } else {
+            dev->fence_timeout_ms = HWC_FENCE_TIMEOUT_MS;
+        }
+    }
+
+    {
+        display_state_t state;
+        display_state_read(&dev->display_ctxs[HWC_DISPLAY_PRIMARY], &state);
+        hwc_trace_open(&dev->trace, state.xres, state.yres, state.vsync_period);
+    }
+    hwc_telemetry_open(&dev->telemetry);
 
     dev->base.common.tag = HARDWARE_DEVICE_TAG;
     dev->base.common.version = HWC_DEVICE_API_VERSION_1_4;
@@ -1079,7 +3414,7 @@ static int hwc_device_open(const struct hw_module_t* module, const char* name,
     dev->base.setActiveConfig = hwc_setActiveConfig;
     dev->base.setCursorPositionAsync = hwc_setCursorPositionAsync;
     //--hwc 1.4 new apis
-    dev->vsync_enable = false;
+    dev->vsync_enable = 0;
     dev->blank_status = false;
     *device = &dev->base.common;
 
@@ -1100,10 +3435,23 @@ static int hwc_device_open(const struct hw_module_t* module, const char* name,
     }
 //#endif
 
+    //without it fences are still handed to the driver, only not timed.
+    if (hwc_fence_waiter_init(&dev->fence_waiter, dev->fence_timeout_ms) == 0) {
+        int err = pthread_create(&dev->fence_thread, NULL, hwc_fence_thread, dev);
+        if (err) {
+            HWC_LOGEB("failed to start fence thread: %s", strerror(err));
+            hwc_fence_waiter_destroy(&dev->fence_waiter);
+        }
+        dev->fence_thread_running = err == 0;
+    }
+
+    dev->open_ns = systemTime(CLOCK_MONOTONIC) - dev->open_time;
     return 0;
 
 err_vsync:
+    hwc_telemetry_close(&dev->telemetry);
     uninit_display(dev,HWC_DISPLAY_PRIMARY);
+    dev->backend.ops->close(&dev->backend);
 err_get_module:
     if (dev) free(dev);
 
@@ -1114,62 +3462,33 @@ err_get_module:
 Operater of framebuffer
 */
 int init_display(hwc_context_1_t* context,int displayType) {
-    get_display_info(context, displayType);
-
-    if (display_ctx->connected) return 0;
+    display_context_t* display_ctx = &context->display_ctxs[displayType];
+    hwc_backend_t* be = &context->backend;
 
     pthread_mutex_lock(&hwc_mutex);
-
-    if ( !display_ctx->fb_hnd ) {
-        //init information from osd.
-        fbinfo->displayType = displayType;
-        fbinfo->fbIdx = getOsdIdx(fbinfo->displayType);
-        int err = init_frame_buffer_locked(fbinfo);
-        int bufferSize = fbinfo->finfo.line_length * fbinfo->info.yres;
-        HWC_LOGDB("init_frame_buffer get fbinfo->fbIdx (%d) fbinfo->info.xres (%d) fbinfo->info.yres (%d)",fbinfo->fbIdx, fbinfo->info.xres,fbinfo->info.yres);
-        int usage = 0; 
-        if (displayType > 0) usage |= GRALLOC_USAGE_EXTERNAL_DISP;
-
-        //Register the framebuffer to gralloc module
-        display_ctx->fb_hnd = new private_handle_t(private_handle_t::PRIV_FLAGS_FRAMEBUFFER, usage, fbinfo->fbSize, 0,
-                                                                    0, fbinfo->fd, bufferSize, 0);
-        context->gralloc_module->base.registerBuffer(&(context->gralloc_module->base),display_ctx->fb_hnd);
-        HWC_LOGDB("init_frame_buffer get frame size %d usage %d",bufferSize,usage);
-    }
-
-    display_ctx->connected = true;
-    pthread_mutex_unlock(&hwc_mutex);
-
-#ifdef ENABLE_CURSOR_LAYER
-    // init cursor framebuffer
-    cursor_context_t* cursor_ctx = &(display_ctx->cursor_ctx);
-    cursor_ctx->show = false;
-    framebuffer_info_t* cbinfo = &(cursor_ctx->cb_info);
-    cbinfo->fd = -1;
-
-    //init information from cursor framebuffer.
-    cbinfo->fbIdx = displayType*2+1;
-    if (1 != cbinfo->fbIdx && 3 != cbinfo->fbIdx) {
-        HWC_LOGEB("invalid fb index: %d, need to check!",cbinfo->fbIdx);
-        return 0;
-    }
-    int err = init_cursor_buffer_locked(cbinfo);
-    if (err != 0) {
-        HWC_LOGEA("init_cursor_buffer_locked failed, need to check!");
+    if (display_ctx->state.connected) {
+        pthread_mutex_unlock(&hwc_mutex);
         return 0;
     }
-    HWC_LOGDB("init_cursor_buffer get cbinfo->fbIdx (%d) cbinfo->info.xres (%d) cbinfo->info.yres (%d)",
-                        cbinfo->fbIdx,
-                        cbinfo->info.xres,
-                        cbinfo->info.yres);
 
-    if ( cbinfo->fd >= 0) {
-        HWC_LOGDA("init_cursor_buffer success!");
-    }else{
-        HWC_LOGEA("init_cursor_buffer fail!");
+    //a reconnecting display keeps its framebuffer and cursor.
+    bool first_init = !display_ctx->initialized;
+    if (first_init) {
+        int err = be->ops->init_display(be, displayType);
+        if (err) {
+            HWC_LOGEB("%s: init display %d fail: %d", be->ops->name, displayType, err);
+            pthread_mutex_unlock(&hwc_mutex);
+            return err;
+        }
+        display_ctx->initialized = true;
     }
-#endif
 
+    display_state_t state = display_ctx->state;
+    state.connected = true;
+    if (state.vsync_period <= 0) state.vsync_period = 16666666;
+    display_state_publish(display_ctx, &state);
+    chk_vinfo(context, displayType);
+    pthread_mutex_unlock(&hwc_mutex);
 
     return 0;
 }
@@ -1177,12 +3496,12 @@ int init_display(hwc_context_1_t* context,int displayType) {
 int uninit_display(hwc_context_1_t* context, int displayType) {
     get_display_info(context, displayType);
 
-    if (!display_ctx->connected) {
-        return 0;
-    }
-
     pthread_mutex_lock(&hwc_mutex);
-    display_ctx->connected = false;
+    if (display_ctx->state.connected) {
+        display_state_t state = display_ctx->state;
+        state.connected = false;
+        display_state_publish(display_ctx, &state);
+    }
     pthread_mutex_unlock(&hwc_mutex);
 
     return 0;
@@ -0,0 +1,29 @@
+LOCAL_PATH:= $(call my-dir)
+include $(CLEAR_VARS)
+
+# hwcomposer.cpp linked against fake framebuffer devices instead of libfbcnf.
+LOCAL_SRC_FILES:=                     \
+        hwc_replay.cpp         \
+        FakeFramebuffer.cpp    \
+        ../hwcomposer.cpp      \
+        ../LayerTrace.cpp      \
+        ../BufferCache.cpp     \
+        ../Telemetry.cpp       \
+        ../CostModel.cpp       \
+        ../FenceWaiter.cpp     \
+
+MESON_GRALLOC_DIR ?= hardware/amlogic/gralloc
+
+LOCAL_C_INCLUDES := \
+        $(LOCAL_PATH)/..       \
+        $(MESON_GRALLOC_DIR)
+
+LOCAL_SHARED_LIBRARIES := liblog libEGL libutils libcutils libhardware libsync libhardware_legacy
+LOCAL_STATIC_LIBRARIES := libomxutil
+LOCAL_CFLAGS += -DMALI_AFBC_GRALLOC=$(HWC_MALI_AFBC_GRALLOC)
+LOCAL_CFLAGS += -DLOG_TAG=\"hwc_replay\"
+
+LOCAL_MODULE:= hwc_replay
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+Stand-in for the framebuffer helpers of libfbcnf.
+
+Tools that link hwcomposer.cpp directly (the trace replayer, benchmarks) use
+these instead of the real osd devices, so nothing is posted to the osds.
+Every "device" is /dev/zero: mmap works, fb ioctls fail harmlessly. The HAL
+still writes the vpp and osd sysfs nodes (video axis, test_screen,
+osd_afbcd, free_scale), run these tools with SurfaceFlinger stopped.
+*/
+
+#define LOG_TAG "HWComposer"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+#include <hardware/hwcomposer.h>
+#include <sync/sync.h>
+// for private_handle_t
+#include <gralloc_priv.h>
+#include <gralloc_helper.h>
+
+#include "FakeFramebuffer.h"
+
+uint32_t fake_fb_xres = 1920;
+uint32_t fake_fb_yres = 1080;
+uint32_t fake_fb_posts = 0;
+
+int getOsdIdx(int display_type) {
+    return display_type == HWC_DISPLAY_PRIMARY ? 0 : 2;
+}
+
+int init_frame_buffer_locked(struct framebuffer_info_t* fbinfo) {
+    fbinfo->fd = open("/dev/zero", O_RDWR | O_CLOEXEC);
+    if (fbinfo->fd < 0) return -errno;
+
+    memset(&fbinfo->info, 0, sizeof(fbinfo->info));
+    memset(&fbinfo->finfo, 0, sizeof(fbinfo->finfo));
+    fbinfo->info.xres = fbinfo->info.xres_virtual = fake_fb_xres;
+    fbinfo->info.yres = fake_fb_yres;
+    fbinfo->info.yres_virtual = fake_fb_yres * 2;
+    fbinfo->info.bits_per_pixel = 32;
+    fbinfo->info.width = (fake_fb_xres * 25.4f) / 160.0f + 0.5f;
+    fbinfo->info.height = (fake_fb_yres * 25.4f) / 160.0f + 0.5f;
+    fbinfo->finfo.line_length = fake_fb_xres * 4;
+    fbinfo->xdpi = fbinfo->ydpi = 160.0f;
+    fbinfo->fps = 60.0f;
+    fbinfo->fbSize = fbinfo->finfo.line_length * fbinfo->info.yres_virtual;
+    return 0;
+}
+
+int fb_post_with_fence_locked(struct framebuffer_info_t* fbinfo, buffer_handle_t hnd, int in_fence) {
+    //the real helper hands in_fence to the osd driver, which owns it from then on.
+    if (in_fence >= 0) {
+        sync_wait(in_fence, 3000);
+        close(in_fence);
+    }
+    fbinfo->currentBuffer = hnd;
+    fake_fb_posts++;
+    return -1;
+}
+
+int init_cursor_buffer_locked(struct framebuffer_info_t* cbinfo) {
+    cbinfo->fd = open("/dev/zero", O_RDWR | O_CLOEXEC);
+    if (cbinfo->fd < 0) return -errno;
+
+    memset(&cbinfo->info, 0, sizeof(cbinfo->info));
+    memset(&cbinfo->finfo, 0, sizeof(cbinfo->finfo));
+    return 0;
+}
+
+int update_cursor_buffer_locked(struct framebuffer_info_t* cbinfo, int xres, int yres) {
+    cbinfo->info.xres = xres;
+    cbinfo->info.yres = yres;
+    cbinfo->finfo.line_length = xres * 4;
+    return 0;
+}
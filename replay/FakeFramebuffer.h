@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HWC_FAKE_FRAMEBUFFER_H
+#define HWC_FAKE_FRAMEBUFFER_H
+
+#include <stdint.h>
+
+//resolution reported by the fake osd, set before opening the HAL.
+extern uint32_t fake_fb_xres;
+extern uint32_t fake_fb_yres;
+//number of fb_post_with_fence_locked calls seen.
+extern uint32_t fake_fb_posts;
+
+#endif
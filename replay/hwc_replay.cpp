@@ -0,0 +1,369 @@
+/*
+ * Copyright (C) 2010 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+hwc_replay: feed a layer-stack trace recorded with sys.hwc.trace.record back
+through the HAL, which is linked in with fake framebuffer devices.
+
+Each recorded prepare is replayed with the recorded input, the HAL's
+composition decisions are compared with the ones recorded by the following
+set, then set is replayed on the same contents. Timings of both calls are
+reported. Acquire fences cannot be recreated and are replayed as -1.
+
+usage: hwc_replay [-l loops] [-v] <trace file>
+*/
+
+#define LOG_TAG "hwc_replay"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <cutils/log.h>
+#include <hardware/hardware.h>
+#include <hardware/hwcomposer.h>
+#include <utils/KeyedVector.h>
+#include <utils/Timers.h>
+#include <utils/Vector.h>
+// for private_handle_t
+#include <gralloc_priv.h>
+
+#include "LayerTrace.h"
+#include "FakeFramebuffer.h"
+
+extern hwc_module_t HAL_MODULE_INFO_SYM;
+
+typedef struct replay_context {
+    hwc_composer_device_1_t *hwc;
+    android::KeyedVector<uint64_t, private_handle_t*> handles;
+    hwc_display_contents_1_t *displays[HWC_NUM_DISPLAY_TYPES];
+    size_t num_displays;
+    bool prepared;
+    bool verbose;
+
+    android::Vector<nsecs_t> prepare_ns;
+    android::Vector<nsecs_t> set_ns;
+    uint32_t mismatches;
+    //layers recorded with more damage rects than the trace holds.
+    uint32_t damage_truncated;
+} replay_context_t;
+
+static private_handle_t* get_handle(replay_context_t *rctx, hwc_trace_layer_t const* t) {
+    ssize_t idx = rctx->handles.indexOfKey(t->handle_id);
+    if (idx >= 0) return rctx->handles.valueAt(idx);
+
+    private_handle_t *hnd = new private_handle_t(t->priv_flags, t->usage, t->size, 0, 0, -1, 0, 0);
+    hnd->format = t->format;
+    hnd->width = t->width;
+    hnd->height = t->height;
+    hnd->stride = t->stride;
+    if (t->size > 0) {
+        //untouched pages cost nothing, only cursor uploads read them.
+        void *base = mmap(NULL, t->size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        hnd->base = (base == MAP_FAILED) ? NULL : base;
+    }
+    rctx->handles.add(t->handle_id, hnd);
+    return hnd;
+}
+
+static void free_displays(replay_context_t *rctx) {
+    for (size_t i = 0; i < rctx->num_displays; i++) {
+        free(rctx->displays[i]);
+        rctx->displays[i] = NULL;
+    }
+    rctx->num_displays = 0;
+    rctx->prepared = false;
+}
+
+//true if n records of size bytes from p still lie within the frame ending at end.
+static bool records_fit(const char *p, const char *end, size_t n, size_t size) {
+    return p <= end && n <= (size_t)(end - p) / size;
+}
+
+//false if the frame's records run past its size, nothing of it is replayed then.
+static bool build_displays(replay_context_t *rctx, hwc_trace_frame_t const* frame) {
+    const char *p = (const char *)frame + sizeof(hwc_trace_frame_t);
+    const char *end = (const char *)frame + frame->size;
+
+    free_displays(rctx);
+    rctx->num_displays = frame->num_displays;
+    if (rctx->num_displays > HWC_NUM_DISPLAY_TYPES) rctx->num_displays = HWC_NUM_DISPLAY_TYPES;
+
+    for (size_t i = 0; i < frame->num_displays; i++) {
+        hwc_trace_display_t const* d = (hwc_trace_display_t const*)p;
+        if (!records_fit(p, end, 1, sizeof(hwc_trace_display_t))
+            || !records_fit(p + sizeof(hwc_trace_display_t), end, d->num_layers, sizeof(hwc_trace_layer_t))) {
+            free_displays(rctx);
+            return false;
+        }
+        p += sizeof(hwc_trace_display_t);
+        if (!d->present || i >= HWC_NUM_DISPLAY_TYPES) {
+            p += d->num_layers * sizeof(hwc_trace_layer_t);
+            continue;
+        }
+
+        hwc_display_contents_1_t *contents = (hwc_display_contents_1_t *)calloc(1,
+                sizeof(hwc_display_contents_1_t) + d->num_layers * sizeof(hwc_layer_1_t));
+        contents->retireFenceFd = -1;
+        contents->flags = d->flags;
+        contents->numHwLayers = d->num_layers;
+        if (i == HWC_DISPLAY_VIRTUAL) contents->outbufAcquireFenceFd = -1;
+
+        for (size_t j = 0; j < d->num_layers; j++) {
+            hwc_trace_layer_t const* t = (hwc_trace_layer_t const*)p;
+            hwc_layer_1_t *l = &contents->hwLayers[j];
+            p += sizeof(hwc_trace_layer_t);
+
+            l->compositionType = t->composition_type;
+            l->hints = t->hints;
+            l->flags = t->flags;
+            l->acquireFenceFd = -1;
+            l->releaseFenceFd = -1;
+            l->surfaceDamage.numRects = t->num_damage;
+            if (t->num_damage > HWC_TRACE_MAX_DAMAGE_RECTS) {
+                l->surfaceDamage.numRects = HWC_TRACE_MAX_DAMAGE_RECTS;
+            }
+            l->surfaceDamage.rects = t->damage;
+            if (t->trace_flags & HWC_TRACE_LAYER_DAMAGE_TRUNCATED) rctx->damage_truncated++;
+            if (t->composition_type == HWC_BACKGROUND) {
+                l->backgroundColor.r = t->background_color >> 24;
+                l->backgroundColor.g = t->background_color >> 16;
+                l->backgroundColor.b = t->background_color >> 8;
+                l->backgroundColor.a = t->background_color;
+                continue;
+            }
+
+            if (t->trace_flags & (HWC_TRACE_LAYER_HAS_HANDLE | HWC_TRACE_LAYER_SIDEBAND)) {
+                l->handle = get_handle(rctx, t);
+            }
+            l->transform = t->transform;
+            l->blending = t->blending;
+            l->planeAlpha = t->plane_alpha;
+            l->sourceCropf = t->source_crop;
+            l->displayFrame = t->display_frame;
+        }
+        rctx->displays[i] = contents;
+    }
+
+    return true;
+}
+
+static bool check_decisions(replay_context_t *rctx, hwc_trace_frame_t const* frame) {
+    const char *p = (const char *)frame + sizeof(hwc_trace_frame_t);
+    const char *end = (const char *)frame + frame->size;
+
+    for (size_t i = 0; i < frame->num_displays; i++) {
+        hwc_trace_display_t const* d = (hwc_trace_display_t const*)p;
+        if (!records_fit(p, end, 1, sizeof(hwc_trace_display_t))
+            || !records_fit(p + sizeof(hwc_trace_display_t), end, d->num_layers, sizeof(hwc_trace_layer_t))) {
+            return false;
+        }
+        p += sizeof(hwc_trace_display_t);
+        hwc_display_contents_1_t *contents = i < rctx->num_displays ? rctx->displays[i] : NULL;
+
+        for (size_t j = 0; j < d->num_layers; j++) {
+            hwc_trace_layer_t const* t = (hwc_trace_layer_t const*)p;
+            p += sizeof(hwc_trace_layer_t);
+            if (!contents || j >= contents->numHwLayers) continue;
+
+            if (contents->hwLayers[j].compositionType != t->composition_type) {
+                rctx->mismatches++;
+                if (rctx->verbose) {
+                    printf("frame %u disp %zu layer %zu: recorded type %d, replayed type %d\n",
+                            frame->seq, i, j, t->composition_type,
+                            contents->hwLayers[j].compositionType);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static void close_fences(replay_context_t *rctx) {
+    for (size_t i = 0; i < rctx->num_displays; i++) {
+        hwc_display_contents_1_t *contents = rctx->displays[i];
+        if (!contents) continue;
+        if (contents->retireFenceFd >= 0) close(contents->retireFenceFd);
+        contents->retireFenceFd = -1;
+        for (size_t j = 0; j < contents->numHwLayers; j++) {
+            hwc_layer_1_t *l = &contents->hwLayers[j];
+            if (l->compositionType == HWC_BACKGROUND) continue;
+            if (l->releaseFenceFd >= 0) close(l->releaseFenceFd);
+            l->releaseFenceFd = -1;
+        }
+    }
+}
+
+//false if the frame is corrupt.
+static bool replay_frame(replay_context_t *rctx, hwc_trace_frame_t const* frame) {
+    nsecs_t start;
+
+    if (frame->call == HWC_TRACE_CALL_PREPARE) {
+        if (!build_displays(rctx, frame)) return false;
+        start = systemTime(CLOCK_MONOTONIC);
+        rctx->hwc->prepare(rctx->hwc, rctx->num_displays, rctx->displays);
+        rctx->prepare_ns.add(systemTime(CLOCK_MONOTONIC) - start);
+        rctx->prepared = true;
+    } else if (frame->call == HWC_TRACE_CALL_SET) {
+        if (rctx->prepared) {
+            if (!check_decisions(rctx, frame)) return false;
+        } else if (!build_displays(rctx, frame)) {
+            //recording started between prepare and set.
+            return false;
+        }
+        start = systemTime(CLOCK_MONOTONIC);
+        rctx->hwc->set(rctx->hwc, rctx->num_displays, rctx->displays);
+        rctx->set_ns.add(systemTime(CLOCK_MONOTONIC) - start);
+        close_fences(rctx);
+        rctx->prepared = false;
+    }
+    return true;
+}
+
+static int cmp_nsecs(const nsecs_t* a, const nsecs_t* b) {
+    return (*a > *b) - (*a < *b);
+}
+
+static void print_stats(const char *name, android::Vector<nsecs_t>& v) {
+    if (v.isEmpty()) {
+        printf("%-8s no calls\n", name);
+        return;
+    }
+
+    v.sort(cmp_nsecs);
+    nsecs_t total = 0;
+    for (size_t i = 0; i < v.size(); i++) total += v[i];
+    printf("%-8s calls=%zu avg=%lldus min=%lldus p50=%lldus p99=%lldus max=%lldus\n", name, v.size(),
+            (long long)ns2us(total / v.size()),
+            (long long)ns2us(v[0]),
+            (long long)ns2us(v[v.size() / 2]),
+            (long long)ns2us(v[(v.size() * 99) / 100]),
+            (long long)ns2us(v[v.size() - 1]));
+}
+
+static void usage() {
+    fprintf(stderr, "usage: hwc_replay [-l loops] [-v] <trace file>\n");
+}
+
+int main(int argc, char** argv) {
+    int loops = 1;
+    bool verbose = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:v")) != -1) {
+        switch (opt) {
+            case 'l':
+                loops = atoi(optarg);
+            break;
+            case 'v':
+                verbose = true;
+            break;
+            default:
+                usage();
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "open %s fail: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+    if ((size_t)st.st_size < sizeof(hwc_trace_header_t)) {
+        fprintf(stderr, "%s is too short\n", argv[optind]);
+        return 1;
+    }
+
+    const char *base = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "mmap fail: %s\n", strerror(errno));
+        return 1;
+    }
+
+    hwc_trace_header_t const* header = (hwc_trace_header_t const*)base;
+    if (header->magic != HWC_TRACE_MAGIC || header->version != HWC_TRACE_VERSION
+        || header->header_size != sizeof(hwc_trace_header_t)
+        || header->frame_size != sizeof(hwc_trace_frame_t)
+        || header->display_size != sizeof(hwc_trace_display_t)
+        || header->layer_size != sizeof(hwc_trace_layer_t)) {
+        fprintf(stderr, "%s is not a hwc trace of version %d\n", argv[optind], HWC_TRACE_VERSION);
+        return 1;
+    }
+
+    if (header->xres && header->yres) {
+        fake_fb_xres = header->xres;
+        fake_fb_yres = header->yres;
+    }
+
+    hw_device_t *device = NULL;
+    int err = HAL_MODULE_INFO_SYM.common.methods->open(&HAL_MODULE_INFO_SYM.common,
+            HWC_HARDWARE_COMPOSER, &device);
+    if (err) {
+        fprintf(stderr, "open hwcomposer fail: %d\n", err);
+        return 1;
+    }
+
+    replay_context_t rctx;
+    memset(rctx.displays, 0, sizeof(rctx.displays));
+    rctx.hwc = (hwc_composer_device_1_t *)device;
+    rctx.num_displays = 0;
+    rctx.prepared = false;
+    rctx.verbose = verbose;
+    rctx.mismatches = 0;
+    rctx.damage_truncated = 0;
+
+    uint32_t frames = 0;
+    for (int loop = 0; loop < loops; loop++) {
+        const char *p = base + header->header_size;
+        const char *end = base + st.st_size;
+        while (p + sizeof(hwc_trace_frame_t) <= end) {
+            hwc_trace_frame_t const* frame = (hwc_trace_frame_t const*)p;
+            if (frame->size < sizeof(hwc_trace_frame_t) || frame->size > (size_t)(end - p)) break;
+            if (!replay_frame(&rctx, frame)) {
+                fprintf(stderr, "frame %u: records run past its %u bytes, trace corrupt\n",
+                        frame->seq, frame->size);
+                break;
+            }
+            p += frame->size;
+            frames++;
+        }
+    }
+    free_displays(&rctx);
+
+    printf("replayed %u calls from %s, %u posts\n", frames, argv[optind], fake_fb_posts);
+    print_stats("prepare", rctx.prepare_ns);
+    print_stats("set", rctx.set_ns);
+    printf("composition mismatches: %u\n", rctx.mismatches);
+    if (rctx.damage_truncated) {
+        printf("damage truncated to %d rects on %u layers, the HAL saw less damage than recorded\n",
+                HWC_TRACE_MAX_DAMAGE_RECTS, rctx.damage_truncated);
+    }
+
+    device->close(device);
+    munmap((void *)base, st.st_size);
+    return rctx.mismatches ? 2 : 0;
+}